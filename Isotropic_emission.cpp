@@ -6,7 +6,511 @@
 #include <iterator>
 #include <math.h>
 #include <fstream>
+#include <sstream>
+#include <string>
+#include <map>
+#include <cstring>
+#include <cstdint>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <functional>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <memory>
+#include <numeric>
+#include <complex>
 #define pi 3.14159265358979323846
+#define GEOTAB_VERSION 1
+#define ENGINE_VERSION 2                                                    // Bump whenever the sampled hits for a given configuration change
+#define STREAM_SIZE 1000000                                                 // Samples per RNG stream
+
+
+// Optional instrumentation, compiled in with -DGEO_PROFILE: every thread keeps wall and CPU time per phase of the
+// calculation plus sample, hit and allocation counters, and --profile writes a JSON summary at the end of the run.
+// Without GEO_PROFILE the macros below are empty, so the normal build has no overhead at all.
+#ifdef GEO_PROFILE
+#include <time.h>
+enum profile_phase {profile_none, profile_source, profile_emission, profile_copies, profile_hit_test, profile_io, profile_n_phases};
+const char* profile_phase_names[profile_n_phases] = {"other", "source", "emission", "copies", "hit_test", "io"};
+
+// CPU time used by the calling thread, in seconds
+double thread_cpu_seconds(){
+    struct timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return now.tv_sec + 1e-9 * now.tv_nsec;
+}
+
+// Timers and counters of one thread
+struct profile_thread {
+    double wall[profile_n_phases] = {0}, cpu[profile_n_phases] = {0};
+    long long samples = 0, hits = 0, buffer_bytes = 0;
+    int phase = profile_none;
+    std::chrono::steady_clock::time_point wall_start;
+    double cpu_start = 0;
+
+    void switch_phase(int next){                                            // Book the time since the last switch on the current phase
+        auto now = std::chrono::steady_clock::now();
+        double cpu_now = thread_cpu_seconds();
+        if (phase != profile_none){
+            wall[phase] += std::chrono::duration<double>(now - wall_start).count();
+            cpu[phase] += cpu_now - cpu_start;
+        }
+        phase = next;
+        wall_start = now;
+        cpu_start = cpu_now;
+    }
+};
+
+std::mutex profile_mutex;
+std::vector<std::unique_ptr<profile_thread>> profile_threads;               // Kept until exit, so finished threads are still reported
+
+profile_thread& profile_this_thread(){
+    thread_local profile_thread* mine = nullptr;
+    if (mine == nullptr){
+        std::lock_guard<std::mutex> lock(profile_mutex);
+        profile_threads.emplace_back(new profile_thread());
+        mine = profile_threads.back().get();
+    }
+    return *mine;
+}
+
+// Switch to a phase for the rest of the scope, then back to the phase before
+struct profile_scope {
+    int previous;
+    profile_scope(int phase){
+        previous = profile_this_thread().phase;
+        profile_this_thread().switch_phase(phase);
+    }
+    ~profile_scope(){
+        profile_this_thread().switch_phase(previous);
+    }
+};
+
+#define PROFILE_PHASE(phase) profile_this_thread().switch_phase(phase)
+#define PROFILE_SCOPE(phase) profile_scope profile_scope_guard(phase)
+#define PROFILE_COUNT(counter, value) (profile_this_thread().counter += (value))
+#else
+#define PROFILE_PHASE(phase)
+#define PROFILE_SCOPE(phase)
+#define PROFILE_COUNT(counter, value)
+#endif
+
+
+// 64-bit FNV-1a hash of a block of bytes, used to address cache entries and to fingerprint loaded maps and models
+uint64_t fnv1a_hash(const void* data, size_t size){
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (size_t i = 0; i < size; i++){
+        hash ^= ((const unsigned char*) data)[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+uint64_t fnv1a_hash(std::string text){
+    return fnv1a_hash(text.data(), text.size());
+}
+
+
+// Build a loaded_type from (name, arguments...) the first time a name is asked for, and return that object from then on.
+// The objects are shared by all threads and kept until exit; every instantiation has its own registry, so each type is
+// loaded through one wrapper (load_source_map, load_emission_model, load_depth_model) with fixed argument types.
+template <class loaded_type, class... argument_types>
+const loaded_type& load_once(std::string name, argument_types... arguments){
+    static std::mutex loaded_mutex;
+    static std::map<std::string, std::unique_ptr<loaded_type>> loaded_objects;
+    std::lock_guard<std::mutex> lock(loaded_mutex);
+    std::unique_ptr<loaded_type>& loaded = loaded_objects[name];
+    if (!loaded){
+        loaded.reset(new loaded_type(name, arguments...));
+    }
+    return *loaded;
+}
+
+
+// Source intensity map: a raw float32 image of map_x * map_y pixels (row by row, x fastest), memory mapped and sampled with a
+// Walker/Vose alias table, so a draw costs O(1) whatever the size of the map. The alias table is built once and kept next to
+// the map as '<map>.alias' (also memory mapped); it is rebuilt when the size or the content hash of the map changes.
+class source_map {
+    public:
+        int n_x, n_y;
+        double pixel;                                                                              // Pixel size in rd
+        uint64_t content_hash;                                                                     // FNV-1a of the map, part of the cache keys
+
+        source_map(std::string filename, int n_x_in, int n_y_in, double pixel_in){                 // Constructor: map the image, load or build the alias table
+            n_x = n_x_in;
+            n_y = n_y_in;
+            pixel = pixel_in;
+            size_t n_pixels = (size_t) n_x * n_y;
+            struct stat info;
+            const float* intensity = (const float*) map_file(filename, image, image_size, info);
+            if (n_x < 1 || n_y < 1 || image_size != n_pixels * sizeof(float)){
+                std::cerr << "ERROR: " << filename << " has " << image_size << " bytes, expected " << n_pixels << " float32 values" << std::endl;
+                exit(0);
+            }
+
+            content_hash = fnv1a_hash(image, image_size);
+
+            std::string alias_path = filename + ".alias";
+            alias_header expected = {{'G', 'E', 'O', 'A', 'L', 'I', 'A', 'S'}, (uint64_t) info.st_size, content_hash, (uint32_t) n_x, (uint32_t) n_y};
+            struct stat alias_info;
+            bool fresh = false;
+            if (stat(alias_path.c_str(), &alias_info) == 0 && (size_t) alias_info.st_size == sizeof(alias_header) + n_pixels * (sizeof(double) + sizeof(uint32_t))){
+                const void* stored = map_file(alias_path, table, table_size, alias_info);
+                fresh = memcmp(stored, &expected, sizeof(alias_header)) == 0;
+                if (!fresh){
+                    munmap(table, table_size);
+                }
+            }
+            if (!fresh){
+                build_alias_table(intensity, n_pixels, expected, alias_path);
+                map_file(alias_path, table, table_size, alias_info);
+            }
+            probability = (const double*) ((const char*) table + sizeof(alias_header));
+            alias = (const uint32_t*) (probability + n_pixels);
+        }
+
+        ~source_map(){                                                                             // Destructor: unmap the files
+            munmap(image, image_size);
+            munmap(table, table_size);
+        }
+
+        // Draw a source position: a pixel from the alias table, then a uniform position inside it
+        template <class generator_type>
+        void sample(generator_type& generator, double& x, double& y) const {
+            std::uniform_real_distribution<double> unit_distr(0, 1);
+            size_t n_pixels = (size_t) n_x * n_y;
+            size_t column = std::min((size_t) (unit_distr(generator) * n_pixels), n_pixels - 1);
+            size_t index = unit_distr(generator) < probability[column] ? column : alias[column];
+            x = ((index % n_x) + unit_distr(generator) - 0.5 * n_x) * pixel;
+            y = ((index / n_x) + unit_distr(generator) - 0.5 * n_y) * pixel;
+        }
+
+    private:
+        struct alias_header {
+            char magic[8];
+            uint64_t map_size;
+            uint64_t map_hash;                                                                     // content_hash of the map it was built from
+            uint32_t n_x, n_y;
+        };
+        void* image;
+        void* table;
+        size_t image_size, table_size;
+        const double* probability;
+        const uint32_t* alias;
+
+        static const void* map_file(std::string filename, void*& mapped, size_t& mapped_size, struct stat& info){
+            int fd = open(filename.c_str(), O_RDONLY);
+            if (fd < 0 || fstat(fd, &info) != 0 || info.st_size == 0){
+                std::cerr << "ERROR: could not open " << filename << std::endl;
+                exit(0);
+            }
+            mapped_size = info.st_size;
+            mapped = mmap(nullptr, mapped_size, PROT_READ, MAP_SHARED, fd, 0);
+            close(fd);
+            if (mapped == MAP_FAILED){
+                std::cerr << "ERROR: could not map " << filename << std::endl;
+                exit(0);
+            }
+            return mapped;
+        }
+
+        // Vose's method: scale the weights to mean 1, then pair every pixel below 1 with one above 1 that donates the rest
+        static void build_alias_table(const float* intensity, size_t n_pixels, alias_header header, std::string alias_path){
+            std::vector<double> probability(n_pixels);
+            std::vector<uint32_t> alias(n_pixels);
+            std::vector<size_t> small, large;
+            double total = 0;
+
+            for (size_t i = 0; i < n_pixels; i++){
+                if (!(intensity[i] >= 0) || std::isinf(intensity[i])){
+                    std::cerr << "ERROR: the source map has a negative or invalid intensity at pixel " << i << std::endl;
+                    exit(0);
+                }
+                total += intensity[i];
+            }
+            if (total <= 0){
+                std::cerr << "ERROR: the source map is empty" << std::endl;
+                exit(0);
+            }
+            for (size_t i = 0; i < n_pixels; i++){
+                probability[i] = intensity[i] * n_pixels / total;
+                alias[i] = i;
+                (probability[i] < 1 ? small : large).push_back(i);
+            }
+            while (!small.empty() && !large.empty()){
+                size_t less = small.back(), more = large.back();
+                small.pop_back();
+                alias[less] = more;
+                probability[more] -= 1 - probability[less];
+                if (probability[more] < 1){
+                    large.pop_back();
+                    small.push_back(more);
+                }
+            }
+            for (size_t i : small){                                         // Only rounding left: these are full pixels
+                probability[i] = 1;
+            }
+            for (size_t i : large){
+                probability[i] = 1;
+            }
+
+            std::string temp_path = alias_path + "." + std::to_string(getpid()) + ".tmp";
+            std::ofstream myFile(temp_path, std::ios::binary);
+            myFile.write((const char*) &header, sizeof(header));
+            myFile.write((const char*) probability.data(), n_pixels * sizeof(double));
+            myFile.write((const char*) alias.data(), n_pixels * sizeof(uint32_t));
+            myFile.close();
+            if (!myFile || rename(temp_path.c_str(), alias_path.c_str()) != 0){
+                std::cerr << "ERROR: could not write the alias table " << alias_path << std::endl;
+                exit(0);
+            }
+        }
+};
+
+
+// Loaded source maps by file name, see load_once
+const source_map& load_source_map(std::string filename, int n_x, int n_y, double pixel){
+    return load_once<source_map>(filename, n_x, n_y, pixel);
+}
+
+
+// Anisotropic emission W(cos theta), given as 'legendre:a1,a2,...' for W = 1 + sum_k a_k P_k(cos theta) or as 'table:<file>' with
+// lines '<cos theta> <W>' covering [-1, 1] (linear in between). Only the forward hemisphere can reach the detector, so emission
+// is sampled there from W by lookup in an inverse CDF table, and the efficiency is 100 * forward_fraction * hits / samples
+// (forward_fraction = 1/2 for isotropic emission, hence the usual factor 50).
+class emission_model {
+    public:
+        std::string spec;
+        double forward_fraction;                                                                   // Share of the emission in the forward hemisphere
+        double mean_weight;                                                                        // Mean of W over the sphere, normalises the weights
+        std::vector<double> inverse_cdf;                                                           // cos theta at CDF levels 0, 1/K, ..., 1
+        std::vector<double> cumulative;                                                            // Integral of W from 0 to cos theta = j / (size - 1)
+        uint64_t content_hash;                                                                     // FNV-1a of the tables, part of the cache keys
+
+        emission_model(std::string spec_in){                                                       // Constructor: parse W and build the tables
+            spec = spec_in;
+            std::string kind = spec.substr(0, spec.find(':'));
+            std::string values = spec.find(':') == std::string::npos ? "" : spec.substr(spec.find(':') + 1);
+            if (kind == "legendre"){
+                std::stringstream stream(values);
+                std::string item;
+                while (std::getline(stream, item, ',')){
+                    char* end = nullptr;
+                    double coefficient = strtod(item.c_str(), &end);
+                    if (item == "" || *end != '\0' || !std::isfinite(coefficient)){
+                        std::cerr << "ERROR: the Legendre coefficients are numbers, 'legendre:a1,a2,...', not '" << item << "'" << std::endl;
+                        exit(0);
+                    }
+                    coefficients.push_back(coefficient);
+                }
+            } else if (kind == "table"){
+                std::ifstream myFile(values);
+                double c, w;
+                while (myFile >> c >> w){
+                    table_c.push_back(c);
+                    table_w.push_back(w);
+                }
+                bool increasing = std::adjacent_find(table_c.begin(), table_c.end(), std::greater_equal<double>()) == table_c.end();
+                if (table_c.size() < 2 || table_c.front() > -1 || table_c.back() < 1 || !increasing){  // W divides by the steps in cos theta
+                    std::cerr << "ERROR: emission table " << values << " needs strictly increasing '<cos theta> <W>' lines covering [-1, 1]" << std::endl;
+                    exit(0);
+                }
+                for (int k = 0; k < table_c.size(); k++){
+                    if (table_w[k] < 0){
+                        std::cerr << "ERROR: emission table " << values << " has a negative W at cos theta = " << table_c[k] << std::endl;
+                        exit(0);
+                    }
+                }
+            } else{
+                std::cerr << "ERROR: the emission is 'legendre:a1,a2,...' or 'table:<file>', not '" << spec << "'" << std::endl;
+                exit(0);
+            }
+
+            // Cumulative integral of W over cos theta on a fine grid, trapezoidal; W must be non-negative on all of [-1, 1]
+            const int n_fine = 1 << 16, n_table = 1 << 14;
+            cumulative.assign(n_fine + 1, 0);
+            double backward = 0;
+            for (int j = 0; j < n_fine; j++){
+                double c_low = -1 + 1.0 * j / n_fine, c_high = -1 + (j + 1.0) / n_fine;
+                if (W(c_low) < 0 || W(c_high) < 0){
+                    std::cerr << "ERROR: the emission W(cos theta) is negative at cos theta = " << c_low << std::endl;
+                    exit(0);
+                }
+                backward += (W(c_low) + W(c_high)) / 2 / n_fine;
+            }
+            for (int j = 0; j < n_fine; j++){
+                double w_low = W(1.0 * j / n_fine), w_high = W((j + 1.0) / n_fine);
+                if (w_low < 0 || w_high < 0){
+                    std::cerr << "ERROR: the emission W(cos theta) is negative at cos theta = " << 1.0 * j / n_fine << std::endl;
+                    exit(0);
+                }
+                cumulative[j + 1] = cumulative[j] + (w_low + w_high) / 2 / n_fine;
+            }
+            double forward = cumulative[n_fine];
+            if (!(forward > 0)){
+                std::cerr << "ERROR: the emission W(cos theta) has no forward component" << std::endl;
+                exit(0);
+            }
+            forward_fraction = forward / (forward + backward);
+            mean_weight = (forward + backward) / 2;
+
+            inverse_cdf.resize(n_table + 1);
+            int j = 0;
+            for (int k = 0; k <= n_table; k++){
+                double level = forward * k / n_table;
+                while (j < n_fine - 1 && cumulative[j + 1] < level){
+                    j++;
+                }
+                double step = cumulative[j + 1] - cumulative[j];
+                double t = step > 0 ? std::min(std::max((level - cumulative[j]) / step, 0.0), 1.0) : 0;
+                inverse_cdf[k] = (j + t) / n_fine;
+            }
+
+            std::vector<double> hashed = inverse_cdf;
+            hashed.push_back(forward_fraction);
+            hashed.push_back(mean_weight);
+            content_hash = fnv1a_hash(hashed.data(), hashed.size() * sizeof(double));
+        }
+
+        // Emission intensity W at cos theta = c
+        double W(double c) const {
+            if (!table_c.empty()){
+                size_t i = std::upper_bound(table_c.begin(), table_c.end(), c) - table_c.begin();
+                i = std::min(std::max(i, (size_t) 1), table_c.size() - 1);
+                double t = (c - table_c[i - 1]) / (table_c[i] - table_c[i - 1]);
+                return table_w[i - 1] + t * (table_w[i] - table_w[i - 1]);
+            }
+            double value = 1, p_previous = 1, p = c;                                               // P_0 and P_1, then Bonnet's recursion
+            for (int k = 1; k <= coefficients.size(); k++){
+                value += coefficients[k - 1] * p;
+                double p_next = ((2 * k + 1) * c * p - k * p_previous) / (k + 1);
+                p_previous = p;
+                p = p_next;
+            }
+            return value;
+        }
+
+        // Forward cos theta for a uniform u in [0, 1): table lookup with linear interpolation, no rejection
+        double sample_cos_theta(double u) const {
+            double position = u * (inverse_cdf.size() - 1);
+            size_t k = std::min((size_t) position, inverse_cdf.size() - 2);
+            return inverse_cdf[k] + (position - k) * (inverse_cdf[k + 1] - inverse_cdf[k]);
+        }
+
+        // Share of all emission that leaves at cos theta >= c_min (c_min >= 0), by linear interpolation in the cumulative table
+        double fraction_above(double c_min) const {
+            double position = std::min(std::max(c_min, 0.0), 1.0) * (cumulative.size() - 1);
+            size_t j = std::min((size_t) position, cumulative.size() - 2);
+            double below = cumulative[j] + (position - j) * (cumulative[j + 1] - cumulative[j]);
+            return (cumulative.back() - below) / (2 * mean_weight);
+        }
+
+    private:
+        std::vector<double> coefficients, table_c, table_w;
+};
+
+
+// Loaded emission models by specification, see load_once
+const emission_model& load_emission_model(std::string spec){
+    return load_once<emission_model>(spec);
+}
+
+
+// Depth profile of an implanted source below its surface, given as 'uniform:<thickness>' for a slab, 'exponential:<mean>' or as
+// 'table:<file>' with lines '<depth> <density>' (depths in rd, ascending from >= 0, density linear in between). A sample
+// emitted at depth d travels z + d to the detector plane, see sample_stream.
+class depth_model {
+    public:
+        std::string spec;
+        uint64_t content_hash;                                                                     // FNV-1a of the profile, part of the cache keys
+
+        depth_model(std::string spec_in){                                                          // Constructor: parse the profile
+            spec = spec_in;
+            kind = spec.substr(0, spec.find(':'));
+            std::string values = spec.find(':') == std::string::npos ? "" : spec.substr(spec.find(':') + 1);
+            if (kind == "uniform" || kind == "exponential"){
+                char* end = nullptr;
+                scale = strtod(values.c_str(), &end);
+                if (values == "" || *end != '\0' || !(scale > 0)){
+                    std::cerr << "ERROR: the " << kind << " depth needs a positive length in rd, '" << kind << ":<length>'" << std::endl;
+                    exit(0);
+                }
+                table_d = {scale};
+            } else if (kind == "table"){
+                std::ifstream myFile(values);
+                double d, density;
+                while (myFile >> d >> density){
+                    if (density < 0){
+                        std::cerr << "ERROR: depth table " << values << " has a negative density at depth " << d << std::endl;
+                        exit(0);
+                    }
+                    table_d.push_back(d);
+                    table_f.push_back(density);
+                }
+                if (table_d.size() < 2 || table_d.front() < 0 || !std::is_sorted(table_d.begin(), table_d.end())){
+                    std::cerr << "ERROR: depth table " << values << " needs at least two '<depth> <density>' lines with ascending depths >= 0" << std::endl;
+                    exit(0);
+                }
+                cumulative.assign(1, 0);
+                for (size_t j = 1; j < table_d.size(); j++){
+                    cumulative.push_back(cumulative.back() + (table_f[j - 1] + table_f[j]) / 2 * (table_d[j] - table_d[j - 1]));
+                }
+                if (!(cumulative.back() > 0)){
+                    std::cerr << "ERROR: depth table " << values << " is empty" << std::endl;
+                    exit(0);
+                }
+            } else{
+                std::cerr << "ERROR: the depth is 'uniform:<thickness>', 'exponential:<mean>' or 'table:<file>', not '" << spec << "'" << std::endl;
+                exit(0);
+            }
+
+            std::string hashed = kind;
+            hashed.append((const char*) table_d.data(), table_d.size() * sizeof(double));
+            hashed.append((const char*) table_f.data(), table_f.size() * sizeof(double));
+            content_hash = fnv1a_hash(hashed);
+        }
+
+        // Depth for a uniform u in [0, 1) by inversion of the CDF; exact for every kind, the table is linear per segment
+        double sample(double u) const {
+            if (kind == "uniform"){
+                return scale * u;
+            }
+            if (kind == "exponential"){
+                return -scale * log1p(-u);
+            }
+            double level = u * cumulative.back();
+            size_t j = std::upper_bound(cumulative.begin(), cumulative.end(), level) - cumulative.begin();
+            j = std::min(std::max(j, (size_t) 1), cumulative.size() - 1);
+            double h = table_d[j] - table_d[j - 1], f_0 = table_f[j - 1], area = level - cumulative[j - 1];
+            if (h <= 0){
+                return table_d[j];
+            }
+            double slope = (table_f[j] - f_0) / h;
+            double root = f_0 + sqrt(std::max(f_0 * f_0 + 2 * slope * area, 0.0));  // Stable root of f_0 x + slope x^2 / 2 = area
+            double x = root > 0 ? 2 * area / root : 0;
+            return table_d[j - 1] + std::min(std::max(x, 0.0), h);
+        }
+
+    private:
+        std::string kind;
+        double scale = 0;
+        std::vector<double> table_d, table_f, cumulative;
+};
+
+
+// Loaded depth profiles by specification, see load_once
+const depth_model& load_depth_model(std::string spec){
+    return load_once<depth_model>(spec);
+}
 
 
 // Define the position class; a vector of xy coordinate pairs and their transformation/calculation functions
@@ -34,6 +538,13 @@ class position {
             }
         }
 
+        void shift(double dx, double dy){                                                           // Translate every point by (dx, dy)
+            for (int i = 0; i < x.size(); i++){
+                x[i] += dx;
+                y[i] += dy;
+            }
+        }
+
         std::vector<double> calculate_rsq(){                                                        // Calculate r^2 of an existing vector
             int size = x.size();
             std::vector<double> r_sq(size);
@@ -59,6 +570,21 @@ class position {
             }
         }
 
+        // On empty position (to be filled), generate extrapolated changes in x and y for forward emission following an emission model
+        void generate_anisotropic(double z, int seed, const emission_model& model){
+            std::default_random_engine generator{(unsigned long) seed};
+            std::uniform_real_distribution<double> phi_distr(0, 2*pi);
+            std::uniform_real_distribution<double> theta_create_distr(0, 1);
+            double phi, theta;
+
+            for (int i = 0; i < x.size(); i++){
+                phi = phi_distr(generator);
+                theta = acos(model.sample_cos_theta(theta_create_distr(generator)));
+                x[i] = z * tan(theta) * cos(phi);
+                y[i] = z * tan(theta) * sin(phi);
+            }
+        }
+
         // On empty position (to be filled), generate a random point inside a uniform circular source
         void generate_circular_distr(double r_s, int seed){
             std::default_random_engine generator{seed};
@@ -74,6 +600,15 @@ class position {
             }
         }
 
+        // On empty position (to be filled), generate random points from a source intensity map
+        void generate_map_distr(const source_map& map, int seed){
+            std::default_random_engine generator{(unsigned long) seed};
+
+            for (int i = 0; i < x.size(); i++){
+                map.sample(generator, x[i], y[i]);
+            }
+        }
+
         // On empty position (to be filled), generate a random point inside a gaussian circular source
         void generate_gaussian_distr(double sigma, int seed){
             std::default_random_engine generator{seed};
@@ -92,6 +627,335 @@ class position {
 };
 
 
+// Circular aperture between source and detector: radius (rd) at distance z (rd), centred at (offset_x, offset_y)
+struct aperture {
+    double z, radius, offset_x, offset_y;
+};
+
+
+// Run configuration; everything needed to label (and reproduce) an output table
+struct geo_config {
+    std::string source_type, detector_type;
+    double source = 0, det_fraction = 1;
+    double offset_x = 0, offset_y = 0;                                      // Source centre displaced from the detector axis (in rd)
+    double det_height = 1;                                                  // Rectangular/pixelated detector: height/width, the width spans [-1, 1]
+    int pixels_x = 1, pixels_y = 1;                                         // Pixelated detector: pixel grid
+    double tilt = 0, tilt_azimuth = 0;                                      // Detector normal tilted by tilt (degrees) towards azimuth tilt_azimuth
+    std::vector<aperture> apertures;                                        // Every ray has to pass all of them to reach the detector
+    std::string emission;                                                   // Anisotropic emission model, see emission_model ("" is isotropic)
+    bool emission_weighted = false;                                         // Sample isotropically and weight hits by W instead of sampling W
+    std::string depth;                                                      // Depth profile of the source, see depth_model ("" is at the surface)
+    std::string source_map_file;                                            // Map source: raw float32 image of map_x * map_y pixels of map_pixel rd
+    int map_x = 0, map_y = 0;
+    double map_pixel = 0;
+    double landing_extent = 0;                                              // Landing histogram: landing_bins^2 bins over [-extent, extent]^2
+    int landing_bins = 0;                                                   // (0 is none)
+    double radial_max = 0;                                                  // Radial histogram: radial_bins bins in r^2 over [0, radial_max^2)
+    int radial_bins = 0;                                                    // (0 is none)
+    int seed = 15763027;                                                    // Randomly picked seed
+    int power = 0;
+    long long n_perpoint = 0;
+    int shard = 0, n_shards = 1;                                            // This run samples the RNG streams s with s % n_shards == shard
+    bool derivatives = false;                                               // Also estimate dE/dz and dE/dsource from the same samples
+    bool single_precision = false;                                          // Sample and project in float, see count_hits_float
+    std::string interval = "wilson";                                        // Confidence intervals: 'wilson' or 'clopper-pearson'
+};
+
+
+// Streaming count, mean and sum of squared deviations (M2) of a sequence of values, in O(1) memory. Values are added one at
+// a time with Welford's update, and the statistics of disjoint sequences (threads, RNG streams, shards) merge exactly with
+// the pairwise update of Chan et al., so neither loses precision against the running mean the way raw sums of x and x^2 do.
+struct running_stats {
+    long long n = 0;
+    double mean = 0, m2 = 0;
+
+    void add(double x){                                                     // Welford
+        n++;
+        double delta = x - mean;
+        mean += delta / n;
+        m2 += delta * (x - mean);
+    }
+
+    void merge(const running_stats& other){                                 // Chan et al.: statistics of the union
+        if (other.n == 0){
+            return;
+        }
+        long long total = n + other.n;
+        double delta = other.mean - mean;
+        mean += delta * other.n / total;
+        m2 += other.m2 + delta * delta * n * other.n / total;
+        n = total;
+    }
+
+    void remove(const running_stats& part){                                 // Inverse of merge: statistics without a subsequence
+        long long rest = n - part.n;
+        if (rest <= 0){
+            *this = running_stats();
+            return;
+        }
+        double rest_mean = (mean * n - part.mean * part.n) / rest;
+        double delta = part.mean - rest_mean;
+        m2 = std::max(m2 - part.m2 - delta * delta * rest * part.n / n, 0.0);
+        mean = rest_mean;
+        n = rest;
+    }
+
+    double sum() const { return mean * n; }
+    double sum_sq() const { return m2 + mean * mean * n; }
+
+
+    void over_samples(long long samples, double& value, double& error) const {  // Mean over samples >= n values, the rest zeros,
+        if (samples <= 0){                                                  // and its standard error
+            value = error = 0;
+            return;
+        }
+        value = sum() / samples;
+        double m2_all = m2 + mean * mean * n * (samples - n) / samples;     // Merged with samples - n zeros
+        error = sqrt(std::max(m2_all, 0.0) / samples / samples);
+    }
+
+    double effective_samples() const {                                      // Kish: (sum x)^2 / sum x^2, zeros do not change it
+        return sum_sq() > 0 ? sum() * sum() / sum_sq() : 0;
+    }
+};
+
+
+// Raw outcome on one circle at a single distance: N_hit hits out of the samples [0, n), with derivatives the statistics over
+// the hits of the likelihood-ratio scores with respect to z and the source spread, and with weighted emission those of the
+// hit weights (the misses score and weigh 0)
+struct point_counts {
+    long long N_hit = 0, n = 0;
+    running_stats score_z, score_source;
+    running_stats weight;                                                   // Weighted-isotropic emission: W / <W> of the hits
+
+    void add(const point_counts& other){                                    // Counts of disjoint samples add up
+        N_hit += other.N_hit;
+        n += other.n;
+        weight.merge(other.weight);
+        score_z.merge(other.score_z);
+        score_source.merge(other.score_source);
+    }
+};
+
+
+// Write a double with enough digits to read back the exact same value
+std::string exact_str(double value){
+    std::ostringstream out;
+    out.precision(17);
+    out << value;
+    return out.str();
+}
+
+
+// Running statistics as '<n> \t <mean> \t <M2>', with enough digits to read back the exact same values
+std::string stats_str(const running_stats& stats){
+    return std::to_string(stats.n) + "\t" + exact_str(stats.mean) + "\t" + exact_str(stats.m2);
+}
+
+
+// Read running statistics written by stats_str
+bool read_stats(std::istream& in, running_stats& stats){
+    return (bool) (in >> stats.n >> stats.mean >> stats.m2);
+}
+
+
+// Split a string at every occurrence of delim
+std::vector<std::string> split(std::string s, char delim){
+    std::vector<std::string> out;
+    std::stringstream stream(s);
+    std::string item;
+
+    while (std::getline(stream, item, delim)){
+        out.push_back(item);
+    }
+    return out;
+}
+
+
+// Join strings with delim in between
+std::string join(std::vector<std::string> items, char delim){
+    std::string out;
+
+    for (int i = 0; i < items.size(); i++){
+        if (i > 0){
+            out += delim;
+        }
+        out += items[i];
+    }
+    return out;
+}
+
+
+// Check the extension of a filename
+bool ends_with(std::string s, std::string suffix){
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+
+// Apertures as text, 'z,radius,offset x,offset y' separated by ';'
+std::string apertures_str(const std::vector<aperture>& apertures){
+    std::vector<std::string> items;
+
+    for (const aperture& a : apertures){
+        items.push_back(exact_str(a.z) + "," + exact_str(a.radius) + "," + exact_str(a.offset_x) + "," + exact_str(a.offset_y));
+    }
+    return join(items, ';');
+}
+
+
+// Read apertures written by apertures_str; the offsets may be left out
+std::vector<aperture> parse_apertures(std::string text){
+    std::vector<aperture> apertures;
+
+    for (std::string item : split(text, ';')){
+        aperture a = {0, 0, 0, 0};
+        if (sscanf(item.c_str(), "%lf,%lf,%lf,%lf", &a.z, &a.radius, &a.offset_x, &a.offset_y) < 2 || a.z <= 0 || a.radius <= 0){
+            std::cerr << "ERROR: an aperture is 'z,radius[,offset x,offset y]' with z > 0 and radius > 0, not '" << item << "'" << std::endl;
+            exit(0);
+        }
+        apertures.push_back(a);
+    }
+    return apertures;
+}
+
+
+// Convert a configuration to key=value parameters for file headers
+std::map<std::string, std::string> config_params(const geo_config& config){
+    std::map<std::string, std::string> params;
+    params["method"] = "monte_carlo_isotropic";
+    params["source_type"] = config.source_type;
+    params["detector_type"] = config.detector_type;
+    params["source"] = exact_str(config.source);
+    params["det_fraction"] = exact_str(config.det_fraction);
+    params["seed"] = std::to_string(config.seed);
+    params["power"] = std::to_string(config.power);
+    params["n_perpoint"] = std::to_string(config.n_perpoint);
+    if (config.detector_type == "rectangular" || config.detector_type == "pixelated"){
+        params["det_height"] = exact_str(config.det_height);
+        params["pixels_x"] = std::to_string(config.pixels_x);
+        params["pixels_y"] = std::to_string(config.pixels_y);
+    }
+    if (config.source_type == "map"){
+        params["source_map"] = config.source_map_file;
+        params["map_x"] = std::to_string(config.map_x);
+        params["map_y"] = std::to_string(config.map_y);
+        params["map_pixel"] = exact_str(config.map_pixel);
+    }
+    if (config.emission != ""){
+        params["emission"] = config.emission;
+        params["emission_sampling"] = config.emission_weighted ? "weighted" : "inverse_cdf";
+    }
+    if (config.depth != ""){
+        params["depth"] = config.depth;
+    }
+    if (config.landing_bins > 0){
+        params["landing_extent"] = exact_str(config.landing_extent);
+        params["landing_bins"] = std::to_string(config.landing_bins);
+    }
+    if (config.radial_bins > 0){
+        params["radial_max"] = exact_str(config.radial_max);
+        params["radial_bins"] = std::to_string(config.radial_bins);
+    }
+    if (!config.apertures.empty()){
+        params["apertures"] = apertures_str(config.apertures);
+    }
+    if (config.tilt != 0){
+        params["tilt"] = exact_str(config.tilt);
+        params["tilt_azimuth"] = exact_str(config.tilt_azimuth);
+    }
+    if (config.offset_x != 0 || config.offset_y != 0){
+        params["offset_x"] = exact_str(config.offset_x);
+        params["offset_y"] = exact_str(config.offset_y);
+    }
+    if (config.n_shards > 1){
+        params["shard"] = std::to_string(config.shard);
+        params["n_shards"] = std::to_string(config.n_shards);
+    }
+    if (config.derivatives){
+        params["derivatives"] = "1";
+    }
+    if (config.single_precision){
+        params["precision"] = "float";
+    }
+    if (config.interval != "wilson"){
+        params["interval"] = config.interval;
+    }
+    return params;
+}
+
+
+// Read a configuration back from key=value parameters
+geo_config config_from_params(std::map<std::string, std::string> params){
+    geo_config config;
+
+    if (params["source_type"] == "" || params["detector_type"] == ""){
+        std::cerr << "ERROR: file does not contain the run parameters" << std::endl;
+        exit(0);
+    }
+    config.source_type = params["source_type"];
+    config.detector_type = params["detector_type"];
+    config.source = std::stod(params["source"]);
+    config.det_fraction = std::stod(params["det_fraction"]);
+    config.seed = std::stoi(params["seed"]);
+    config.power = std::stoi(params["power"]);
+    config.n_perpoint = std::stoll(params["n_perpoint"]);
+    if (params["det_height"] != ""){
+        config.det_height = std::stod(params["det_height"]);
+        config.pixels_x = std::stoi(params["pixels_x"]);
+        config.pixels_y = std::stoi(params["pixels_y"]);
+    }
+    if (config.source_type == "map"){
+        config.source_map_file = params["source_map"];
+        config.map_x = std::stoi(params["map_x"]);
+        config.map_y = std::stoi(params["map_y"]);
+        config.map_pixel = std::stod(params["map_pixel"]);
+    }
+    if (params["emission"] != ""){
+        config.emission = params["emission"];
+        config.emission_weighted = params["emission_sampling"] == "weighted";
+    }
+    config.depth = params["depth"];
+    if (params["landing_bins"] != ""){
+        config.landing_extent = std::stod(params["landing_extent"]);
+        config.landing_bins = std::stoi(params["landing_bins"]);
+    }
+    if (params["radial_bins"] != ""){
+        config.radial_max = std::stod(params["radial_max"]);
+        config.radial_bins = std::stoi(params["radial_bins"]);
+    }
+    if (params["apertures"] != ""){
+        config.apertures = parse_apertures(params["apertures"]);
+    }
+    if (params["tilt"] != ""){
+        config.tilt = std::stod(params["tilt"]);
+        config.tilt_azimuth = std::stod(params["tilt_azimuth"]);
+    }
+    if (params["offset_x"] != ""){
+        config.offset_x = std::stod(params["offset_x"]);
+        config.offset_y = std::stod(params["offset_y"]);
+    }
+    if (params["n_shards"] != ""){
+        config.shard = std::stoi(params["shard"]);
+        config.n_shards = std::stoi(params["n_shards"]);
+    }
+    config.derivatives = params["derivatives"] == "1";
+    config.single_precision = params["precision"] == "float";
+    if (params["interval"] != ""){
+        config.interval = params["interval"];
+    }
+    return config;
+}
+
+
+// Read a source offset given as dx,dy (in rd)
+void parse_offset(std::string text, geo_config& config){
+    if (sscanf(text.c_str(), "%lf,%lf", &config.offset_x, &config.offset_y) != 2){
+        std::cerr << "ERROR: --offset expects dx,dy in units of rd" << std::endl;
+        exit(0);
+    }
+}
+
+
 // Make a linspace
 std::vector<double> linspace(double min, double max, int nr_points){
     std::vector<double> out(nr_points);
@@ -104,138 +968,3426 @@ std::vector<double> linspace(double min, double max, int nr_points){
 }
 
 
-// Calculate the point source approximation value for the values in vector z
-std::vector<double> point_source(std::vector<double> z) {
+// Calculate the point source approximation value for the values in vector z, for a point at a distance offset (in rd) from the axis.
+// Off the axis the solid angle of the detector disk follows from complete elliptic integrals and Heuman's lambda function.
+std::vector<double> point_source(std::vector<double> z, double offset = 0) {
     int size = z.size();
     std::vector<double> ps(size);
     double temp;
 
     for (int i = 0; i < size; i++) {
-        temp = 50 - (50 * z[i]) / (sqrt(1 + pow(z[i], 2)));
+        if (offset == 0){
+            temp = 50 - (50 * z[i]) / (sqrt(1 + pow(z[i], 2)));
+        } else{
+            double r_max = sqrt(z[i] * z[i] + (offset + 1) * (offset + 1));
+            double r_min = sqrt(z[i] * z[i] + (offset - 1) * (offset - 1));
+            double k = sqrt(1 - r_min * r_min / (r_max * r_max)), k_c = r_min / r_max;
+            double K = std::comp_ellint_1(k);
+            double xi = atan(z[i] / fabs(1 - offset));
+            double heuman_lambda = 2 / pi * (std::comp_ellint_2(k) * std::ellint_1(k_c, xi) + K * std::ellint_2(k_c, xi) - K * std::ellint_1(k_c, xi));
+            double solid_angle = -2 * z[i] / r_max * K;
+            if (offset < 1){
+                solid_angle += 2 * pi - pi * heuman_lambda;
+            } else if (offset == 1){
+                solid_angle += pi;
+            } else{
+                solid_angle += pi * heuman_lambda;
+            }
+            temp = 25 * solid_angle / pi;
+        }
         ps[i] = temp;
     }
     return ps;
 }
 
 
-// Calculate the geometric efficiency at a specific distance
-double geom_eff_point(double z, double source, int n, int seed, std::string source_type){
-    int N_hit = 0;                                                          // Initialize hit counter
-    std::vector<double> x1(n), x2(n), y1(n), y2(n);
-    
-    position generate_source(x1, y1);
-    position generate_emission(x2, y2);
-     
-    if (source_type == "uniform"){                                          // Generate source position
-        generate_source.generate_circular_distr(source, seed);
-    } else if (source_type == "gaussian"){
-        generate_source.generate_gaussian_distr(source, seed);
+// Add the likelihood-ratio scores of a hit with emission displacement (dx, dy) from source position (xi_x, xi_y), see point_derivatives
+void add_hit_scores(point_counts& counts, const geo_config& config, double z, double dx, double dy, double xi_x, double xi_y){
+    double denominator = z * z + dx * dx + dy * dy;
+    double score_z = 1 / z - 3 * z / denominator;
+    double score_source = config.source > 0 ? 3 * (xi_x * dx + xi_y * dy) / (config.source * denominator) : 0;
+    counts.score_z.add(score_z);
+    counts.score_source.add(score_source);
+}
+
+
+// Fill an empty position with the source points of the configured distribution
+void generate_source_distr(const geo_config& config, position& generate_source, int seed){
+    if (config.source_type == "uniform"){
+        generate_source.generate_circular_distr(config.source, seed);
+    } else if (config.source_type == "gaussian"){
+        generate_source.generate_gaussian_distr(config.source, seed);
+    } else if (config.source_type == "map"){
+        generate_source.generate_map_distr(load_source_map(config.source_map_file, config.map_x, config.map_y, config.map_pixel), seed);
     } else{
-        std::cerr << "ERROR: Not a valid source type. Choose 'circular' or 'gaussian'" << std::endl;
+        std::cerr << "ERROR: Not a valid source type. Choose 'uniform', 'gaussian' or 'map'" << std::endl;
         exit(0);
     }
-    
-    seed++;                                                                 // Increment seed to avoid correlated random numbers
-    generate_emission.generate_isotropic(z, seed);                          // Extrapolated position at the same distance as the detector
-    generate_source.add_vec(generate_emission.x, generate_emission.y);
-    std::vector<double> r_final = generate_source.calculate_rsq();          // Calculate r for the extrapolated end position
+}
+
+
+// Emission depths of the n samples of one RNG stream, or nothing for a surface source. They come from their own generator,
+// seeded through a seed_seq from (seed, stream), so the source and emission draws of a stream are the same with or without depth.
+std::vector<double> sample_depths(const geo_config& config, long long stream, int n){
+    if (config.depth == ""){
+        return std::vector<double>();
+    }
+    const depth_model& model = load_depth_model(config.depth);
+    std::seed_seq sequence{(uint32_t) config.seed, (uint32_t) stream, (uint32_t) (stream >> 32), (uint32_t) 3};  // 3: depth draws
+    std::default_random_engine generator(sequence);
+    std::uniform_real_distribution<double> unit_distr(0, 1);
+    std::vector<double> depth(n);
 
-    // Check if it was a hit or a miss
     for (int i = 0; i < n; i++){
-        if (r_final[i] <= 1){
-            N_hit++;                                                        // Add 1 to hit counter
-        }
+        depth[i] = model.sample(unit_distr(generator));
     }
-    return 50.0*N_hit/n;                                                    // Get hit/emitted percentage, note isotropic distribution is extrapolated to the detector side -> 1/2
+    return depth;
 }
 
 
-// Write the output file
-void write_geo_file(std::vector<double> z, std::vector<double> efficiencies, std::vector<double> rel_ers, std::string filename) {
-    std::vector<double> e_ps = point_source(z);
-    std::ofstream myFile(filename);
-    myFile << "z/rd \t point source \t Model \t Relative uncertainty \n";
+// Fill the landing points (source + offset + emission) and the emission displacements of all samples of one RNG stream.
+// With a depth profile the depths go to depth, and the displacement of sample i is that over the distance z + depth[i]:
+// the directions are then drawn at unit distance and scaled per sample, which also holds for a source plane at z = 0.
+void sample_stream(const geo_config& config, double z, long long stream, position& generate_source, position& generate_emission, std::vector<double>& depth){
+    int stream_seed = config.seed + 2 * stream;
+    double emission_z = config.depth == "" ? z : 1;                         // Distance the emission is drawn at
+    PROFILE_PHASE(profile_copies);
+    PROFILE_COUNT(samples, generate_source.x.size());
+    PROFILE_COUNT(buffer_bytes, 11 * sizeof(double) * generate_source.x.size());  // x1..y2, their copies in position, the add_vec arguments and r_final
 
-    for (int i = 0; i < z.size(); i++) {
-        myFile << z[i] << "\t" << e_ps[i] << "\t" << efficiencies[i] << "\t" << rel_ers[i]<< "\n";
+    PROFILE_PHASE(profile_source);
+    generate_source_distr(config, generate_source, stream_seed);            // Generate source position
+
+    stream_seed++;                                                          // Increment seed to avoid correlated random numbers
+    PROFILE_PHASE(profile_emission);
+    if (config.emission != "" && !config.emission_weighted){
+        generate_emission.generate_anisotropic(emission_z, stream_seed, load_emission_model(config.emission));
+    } else{
+        generate_emission.generate_isotropic(emission_z, stream_seed);      // Extrapolated position at the same distance as the detector
+    }
+    depth = sample_depths(config, stream, generate_emission.x.size());
+    for (int i = 0; i < depth.size(); i++){                                 // Same direction, the way from its depth to the detector plane
+        generate_emission.x[i] *= z + depth[i];
+        generate_emission.y[i] *= z + depth[i];
+    }
+    PROFILE_PHASE(profile_copies);
+    generate_source.add_vec(generate_emission.x, generate_emission.y);
+    if (config.offset_x != 0 || config.offset_y != 0){
+        generate_source.shift(config.offset_x, config.offset_y);
+    }
+}
+
+
+// Point source approximation for a rectangular detector [-1, 1] x [-height, height] seen from a point at (offset_x, offset_y):
+// the solid angle of the rectangle from corner terms atan(x y / (z sqrt(x^2 + y^2 + z^2))), with signs by corner
+std::vector<double> point_source_rectangle(std::vector<double> z, double height, double offset_x, double offset_y) {
+    int size = z.size();
+    std::vector<double> ps(size);
+
+    for (int i = 0; i < size; i++) {
+        auto corner = [&](double x, double y){
+            return atan(x * y / (z[i] * sqrt(x * x + y * y + z[i] * z[i])));
+        };
+        double x_low = -1 - offset_x, x_high = 1 - offset_x, y_low = -height - offset_y, y_high = height - offset_y;
+        double solid_angle = corner(x_high, y_high) - corner(x_low, y_high) - corner(x_high, y_low) + corner(x_low, y_low);
+        ps[i] = 25 * solid_angle / pi;
+    }
+    return ps;
+}
+
+
+// Unit normal of the detector plane, tilted by tilt degrees from the z axis towards azimuth tilt_azimuth
+void detector_normal(const geo_config& config, double& n_x, double& n_y, double& n_z){
+    double tilt = config.tilt * pi / 180, azimuth = config.tilt_azimuth * pi / 180;
+    n_x = sin(tilt) * cos(azimuth);
+    n_y = sin(tilt) * sin(azimuth);
+    n_z = cos(tilt);
+}
+
+
+// Point source approximation for a tilted detector disk of unit radius centred at (0, 0, z): the solid angle seen from
+// (offset_x, offset_y, 0) by midpoint quadrature of n.(q - s) / |q - s|^3 over the disk
+std::vector<double> point_source_tilted(const geo_config& config, std::vector<double> z) {
+    const int n_r = 400, n_phi = 400;
+    int size = z.size();
+    std::vector<double> ps(size);
+    double n_x, n_y, n_z;
+    detector_normal(config, n_x, n_y, n_z);
+
+    double e1_x = n_z, e1_y = 0, e1_z = -n_x;                               // In-plane basis: e1 = normalised (y x n), e2 = n x e1
+    double e1_norm = sqrt(e1_x * e1_x + e1_z * e1_z);
+    e1_x /= e1_norm;
+    e1_z /= e1_norm;
+    double e2_x = n_y * e1_z, e2_y = n_z * e1_x - n_x * e1_z, e2_z = -n_y * e1_x;
+
+    for (int i = 0; i < size; i++) {
+        double solid_angle = 0;
+        for (int a = 0; a < n_r; a++){
+            double r = (a + 0.5) / n_r;
+            for (int b = 0; b < n_phi; b++){
+                double phi = 2 * pi * (b + 0.5) / n_phi;
+                double q_x = r * cos(phi) * e1_x + r * sin(phi) * e2_x - config.offset_x;
+                double q_y = r * cos(phi) * e1_y + r * sin(phi) * e2_y - config.offset_y;
+                double q_z = z[i] + r * cos(phi) * e1_z + r * sin(phi) * e2_z;
+                double distance_sq = q_x * q_x + q_y * q_y + q_z * q_z;
+                solid_angle += fabs(n_x * q_x + n_y * q_y + n_z * q_z) / (distance_sq * sqrt(distance_sq)) * r;
+            }
+        }
+        ps[i] = 25 * solid_angle * (2 * pi / n_phi) / n_r / pi;
+    }
+    return ps;
+}
+
+
+// Point source approximation behind apertures or with anisotropic emission, for a circular detector or a rectangle
+// [-1, 1] x [-height, height] seen from (offset_x, offset_y). Along each azimuth phi around that point the rays inside the
+// detector and every aperture (all convex) land at distances [t_low, t_high] from it in the detector plane, so the share of
+// the emission in that azimuth follows exactly from the polar angles at t_low and t_high (W only depends on the polar
+// angle, see emission_model::fraction_above); the midpoint rule then sums over phi.
+std::vector<double> point_source_rays(const geo_config& config, std::vector<double> z) {
+    const int n_phi = 1 << 12;
+    bool rectangle = config.detector_type == "rectangular" || config.detector_type == "pixelated";
+    const emission_model* emission = config.emission != "" ? &load_emission_model(config.emission) : nullptr;
+    int size = z.size();
+    std::vector<double> ps(size);
+    double u_x, u_y, t_low, t_high;
+    std::vector<std::complex<double>> directions(n_phi);                    // Unit vectors at the midpoints of the azimuth steps
+    for (int k = 0; k < n_phi; k++){
+        directions[k] = std::polar(1.0, 2 * pi * (k + 0.5) / n_phi);
+    }
+
+    auto clip_disk = [&](double c_x, double c_y, double radius, double scale){  // Inside a disk around (c_x, c_y) in the plane at scale * z
+        double d_x = config.offset_x - c_x, d_y = config.offset_y - c_y;
+        double b = d_x * u_x + d_y * u_y, discriminant = b * b - (d_x * d_x + d_y * d_y - radius * radius);
+        if (discriminant < 0){
+            t_high = -1;
+            return;
+        }
+        t_low = std::max(t_low, (-b - sqrt(discriminant)) / scale);
+        t_high = std::min(t_high, (-b + sqrt(discriminant)) / scale);
+    };
+    auto clip_slab = [&](double s, double u, double half_width){            // |s + t u| <= half_width
+        if (u == 0){
+            t_high = fabs(s) <= half_width ? t_high : -1;
+            return;
+        }
+        double t_1 = (-half_width - s) / u, t_2 = (half_width - s) / u;
+        t_low = std::max(t_low, std::min(t_1, t_2));
+        t_high = std::min(t_high, std::max(t_1, t_2));
+    };
+
+    for (int i = 0; i < size; i++) {
+        auto cos_theta = [&](double t){
+            return t > 0 ? z[i] / sqrt(z[i] * z[i] + t * t) : 1;
+        };
+        double share = 0;
+        for (int k = 0; k < n_phi; k++){
+            u_x = directions[k].real();
+            u_y = directions[k].imag();
+            t_low = 0;
+            t_high = INFINITY;
+            if (rectangle){
+                clip_slab(config.offset_x, u_x, 1);
+                clip_slab(config.offset_y, u_y, config.det_height);
+            } else{
+                clip_disk(0, 0, 1, 1);
+            }
+            for (const aperture& a : config.apertures){
+                clip_disk(a.offset_x, a.offset_y, a.radius, a.z / z[i]);
+            }
+            if (t_high > t_low && emission){
+                share += emission->fraction_above(cos_theta(t_high)) - emission->fraction_above(cos_theta(t_low));
+            } else if (t_high > t_low){
+                share += (cos_theta(t_low) - cos_theta(t_high)) / 2;
+            }
+        }
+        ps[i] = 100 * share / n_phi;
+    }
+    return ps;
+}
+
+
+// Point source approximation for the detector of a run. With a depth profile it is the mean over depth of the point source
+// at distance z + depth (apertures move away with it), by the midpoint rule over the quantiles of the profile.
+std::vector<double> detector_point_source(const geo_config& config, std::vector<double> z){
+    if (config.depth != ""){
+        bool quadrature = config.tilt != 0 || config.emission != "" || !config.apertures.empty();
+        const int n_levels = quadrature ? 32 : 256;                         // The tilted point source and point_source_rays are themselves quadratures
+        const depth_model& model = load_depth_model(config.depth);
+        geo_config at_depth = config;
+        at_depth.depth = "";
+        std::vector<double> ps(z.size(), 0);
+        for (int k = 0; k < n_levels; k++){
+            double d = model.sample((k + 0.5) / n_levels);
+            std::vector<double> z_deeper = z;
+            for (double& z_point : z_deeper){
+                z_point += d;
+            }
+            for (int a = 0; a < config.apertures.size(); a++){
+                at_depth.apertures[a].z = config.apertures[a].z + d;
+            }
+            std::vector<double> ps_deeper = detector_point_source(at_depth, z_deeper);
+            for (int i = 0; i < z.size(); i++){
+                ps[i] += ps_deeper[i] / n_levels;
+            }
+        }
+        return ps;
+    }
+    if (config.tilt != 0){
+        return point_source_tilted(config, z);
+    }
+    if (!config.apertures.empty() || config.emission != ""){
+        return point_source_rays(config, z);
+    }
+    if (config.detector_type == "rectangular" || config.detector_type == "pixelated"){
+        return point_source_rectangle(z, config.det_height, config.offset_x, config.offset_y);
+    }
+    return point_source(z, hypot(config.offset_x, config.offset_y));
+}
+
+
+// Indices in [begin, n) of the samples that pass every aperture. The point of a ray in an aperture plane follows from its
+// landing point at z by scaling back the emission displacement (over z + depth[i] from a sample at depth). After each aperture
+// the surviving indices are compacted (without branches), so the next aperture and the detector test only see the rays that are still alive.
+std::vector<int> aperture_survivors(const geo_config& config, double z, const position& landing, const position& emission, const std::vector<double>& depth, int begin, int n){
+    std::vector<int> survivors(n - begin);
+    std::iota(survivors.begin(), survivors.end(), begin);
+
+    for (const aperture& a : config.apertures){
+        double back = 1 - a.z / z, r_max_sq = a.radius * a.radius;
+        int kept = 0;
+        for (int i : survivors){
+            if (!depth.empty()){
+                back = (z - a.z) / (z + depth[i]);
+            }
+            double x = landing.x[i] - back * emission.x[i] - a.offset_x, y = landing.y[i] - back * emission.y[i] - a.offset_y;
+            survivors[kept] = i;
+            kept += x * x + y * y <= r_max_sq;
+        }
+        survivors.resize(kept);
+    }
+    return survivors;
+}
+
+
+// Grid of landing-position bins in the detector plane: n_x * n_y square bins of size bin (rd) with the lower left corner at
+// (x_min, y_min); bin (ix, iy) is histogram entry iy * n_x + ix
+struct landing_grid {
+    double x_min = 0, y_min = 0, bin = 1;
+    int n_x = 0, n_y = 0;
+};
+
+
+// Grid of the landing histogram of a run: landing_bins x landing_bins bins over [-landing_extent, landing_extent]^2
+landing_grid histogram_grid(const geo_config& config){
+    landing_grid grid;
+    grid.n_x = grid.n_y = config.landing_bins;
+    grid.bin = 2 * config.landing_extent / config.landing_bins;
+    grid.x_min = grid.y_min = -config.landing_extent;
+    return grid;
+}
+
+
+// Add the landing points of the given samples to a histogram on the grid, dropping points outside it. The bin follows from the
+// coordinates by integer truncation; every thread fills its own histogram and they are added up at the end, so there is no locking.
+void bin_landings(const landing_grid& grid, const position& landing, const std::vector<int>& samples, std::vector<long long>& histogram){
+    const double scale = 1 / grid.bin;
+
+    for (int i : samples){
+        double u = (landing.x[i] - grid.x_min) * scale, v = (landing.y[i] - grid.y_min) * scale;
+        if (u >= 0 && u < grid.n_x && v >= 0 && v < grid.n_y){
+            histogram[(size_t) v * grid.n_x + (size_t) u]++;
+        }
+    }
+}
+
+
+// Add the squared landing radii of the given samples to a histogram of radial_bins bins over [0, radial_max^2), dropping those
+// beyond; bins of equal width in r^2 are rings of equal area
+void bin_radii(const geo_config& config, const position& landing, const std::vector<int>& samples, std::vector<long long>& histogram){
+    const double scale = config.radial_bins / (config.radial_max * config.radial_max);
+
+    for (int i : samples){
+        double u = (landing.x[i] * landing.x[i] + landing.y[i] * landing.y[i]) * scale;
+        if (u < config.radial_bins){
+            histogram[(size_t) u]++;
+        }
+    }
+}
+
+
+// Histograms of the samples of one distance that a run asks for (the others stay empty), filled by the kernels
+struct sample_histograms {
+    std::vector<long long> landing;                                         // Landing points, see histogram_grid
+    std::vector<long long> radial;                                          // Squared landing radii, see bin_radii
+
+    void add(const std::vector<int>& samples, const geo_config& config, const landing_grid& grid, const position& landing_points){
+        if (!landing.empty()){
+            bin_landings(grid, landing_points, samples, landing);
+        }
+        if (!radial.empty()){
+            bin_radii(config, landing_points, samples, radial);
+        }
+    }
+};
+
+
+// Count the hits on a centred circle of the given radius (in detector radius units) among samples [first, last) at distance z,
+// from a source centred at (config.offset_x, config.offset_y). A tilted detector goes to count_hits_tilted.
+// Sample i is sample i % STREAM_SIZE of RNG stream i / STREAM_SIZE, which draws the source from seed + 2*stream and the emission
+// from seed + 2*stream + 1; a sample therefore does not depend on how a run is split, and counts can be extended later on.
+// With config.derivatives the likelihood-ratio scores of the hits are summed as well, see point_derivatives, and with histograms
+// the landing points of all samples that pass the apertures are added to the histograms of the run.
+point_counts count_hits_float(const geo_config& config, double z, double radius, long long first, long long last);
+point_counts count_hits_tilted(const geo_config& config, double z, double radius, long long first, long long last);
+
+point_counts count_hits(const geo_config& config, double z, double radius, long long first, long long last, sample_histograms* histograms = nullptr){
+    if (config.single_precision){
+        return count_hits_float(config, z, radius, first, last);
+    }
+    if (config.tilt != 0){
+        return count_hits_tilted(config, z, radius, first, last);
+    }
+
+    point_counts counts;                                                    // Initialize hit counter
+    counts.n = last - first;
+    const emission_model* emission = config.emission_weighted ? &load_emission_model(config.emission) : nullptr;
+    const landing_grid grid = histogram_grid(config);
+
+    for (long long stream = first / STREAM_SIZE; stream * STREAM_SIZE < last; stream++){
+        int begin = std::max(first - stream * STREAM_SIZE, 0LL);            // Range of this stream still to be counted
+        int n = std::min(last - stream * STREAM_SIZE, (long long) STREAM_SIZE);
+        std::vector<double> x1(n), x2(n), y1(n), y2(n);
+
+        position generate_source(x1, y1);
+        position generate_emission(x2, y2);
+        std::vector<double> depth;
+        sample_stream(config, z, stream, generate_source, generate_emission, depth);
+        PROFILE_PHASE(profile_hit_test);
+        std::vector<double> r_final = generate_source.calculate_rsq();      // Calculate r for the extrapolated end position
+
+        // Check if it was a hit or a miss
+        double r_max_sq = radius * radius;
+        std::vector<int> survivors = aperture_survivors(config, z, generate_source, generate_emission, depth, begin, n);
+        if (histograms){
+            histograms->add(survivors, config, grid, generate_source);
+        }
+        for (int i : survivors){
+            if (r_final[i] <= r_max_sq){
+                counts.N_hit++;                                             // Add 1 to hit counter
+                double z_i = depth.empty() ? z : z + depth[i];             // Distance travelled to the detector plane
+
+                if (config.emission_weighted){                              // W at the folded direction, relative to its mean
+                    double dx = generate_emission.x[i], dy = generate_emission.y[i];
+                    counts.weight.add(emission->W(z_i / sqrt(z_i * z_i + dx * dx + dy * dy)) / emission->mean_weight);
+                }
+
+                if (config.derivatives){
+                    double dx = generate_emission.x[i], dy = generate_emission.y[i];
+                    add_hit_scores(counts, config, z_i, dx, dy, generate_source.x[i] - dx - config.offset_x, generate_source.y[i] - dy - config.offset_y);
+                }
+            }
+        }
+    }
+    PROFILE_PHASE(profile_none);
+    PROFILE_COUNT(hits, counts.N_hit);
+    return counts;
+}
+
+
+// Single-precision version of count_hits: the same random draws in the same order, stored as float (half the memory of the
+// double path) and turned into a landing point with float arithmetic in one fused loop, with integer hit counting.
+// Rounding error of the float projection: with c = cos(theta) stored exactly, sin(theta) = sqrt((1 - c)(1 + c)) and every
+// other step are accurate to a few ulp, so r^2 is off by less than ~8 eps (r_s + |t|)^2 with eps = 2^-24 and t = z tan(theta).
+// A sample within 32 eps ((r_s + |t|)^2 + R^2) of the edge is therefore re-evaluated in double from the same draws; this also
+// catches the grazing angles (c -> 0) where t, and with it the float error, blows up. What is left is the rounding of the draws
+// themselves to float (relative 6e-8), which moves a landing point by ~1e-7 (1 + |t|) detector radii; the bias on the
+// efficiency is the fraction of samples in such a band at the edge, below 1e-6 relative and far below the statistical error
+// of any feasible run (1e-5 at Power 10).
+point_counts count_hits_float(const geo_config& config, double z, double radius, long long first, long long last){
+    point_counts counts;                                                    // Initialize hit counter
+    counts.n = last - first;
+    const float eps = 1.0f / (1 << 24);
+    const float z_f = z, r_max_sq = radius * radius;
+    const float offset_x = config.offset_x, offset_y = config.offset_y, offset = fabsf(offset_x) + fabsf(offset_y);
+
+    for (long long stream = first / STREAM_SIZE; stream * STREAM_SIZE < last; stream++){
+        int begin = std::max(first - stream * STREAM_SIZE, 0LL);            // Range of this stream still to be counted
+        int n = std::min(last - stream * STREAM_SIZE, (long long) STREAM_SIZE);
+        int stream_seed = config.seed + 2 * stream;
+        PROFILE_PHASE(profile_source);
+        PROFILE_COUNT(samples, n);
+        PROFILE_COUNT(buffer_bytes, 4 * sizeof(float) * n);
+        std::vector<float> phi_source(n), r_source(n), phi_emission(n), cos_theta(n);
+
+        std::default_random_engine source_generator{(unsigned long) stream_seed};
+        std::default_random_engine emission_generator{(unsigned long) stream_seed + 1};
+        std::uniform_real_distribution<double> phi_distr(0, 2*pi);
+        std::uniform_real_distribution<double> unit_distr(0, 1);
+        std::normal_distribution<double> r_distr(0, config.source);
+
+        for (int i = 0; i < n; i++){                                        // Same draws as generate_circular_distr / generate_gaussian_distr
+            phi_source[i] = phi_distr(source_generator);
+            if (config.source_type == "uniform"){
+                r_source[i] = config.source * sqrt(unit_distr(source_generator));
+            } else if (config.source_type == "gaussian"){
+                r_source[i] = r_distr(source_generator);
+            } else{
+                std::cerr << "ERROR: '--float' only supports the 'uniform' and 'gaussian' sources, not '" << config.source_type << "'" << std::endl;
+                exit(0);
+            }
+        }
+        PROFILE_PHASE(profile_emission);
+        for (int i = 0; i < n; i++){                                        // Same draws as generate_isotropic
+            phi_emission[i] = phi_distr(emission_generator);
+            cos_theta[i] = 1 - 2 * unit_distr(emission_generator);
+        }
+
+        // Project and check if it was a hit or a miss
+        PROFILE_PHASE(profile_hit_test);
+        for (int i = begin; i < n; i++){
+            float c = cos_theta[i];
+            float t = z_f * sqrtf((1 - c) * (1 + c)) / c;                  // z tan(theta)
+            float dx = t * cosf(phi_emission[i]), dy = t * sinf(phi_emission[i]);
+            float x = r_source[i] * cosf(phi_source[i]) + offset_x + dx, y = r_source[i] * sinf(phi_source[i]) + offset_y + dy;
+            float r_sq = x * x + y * y;
+            float reach = fabsf(r_source[i]) + offset + fabsf(t);
+            bool hit = r_sq <= r_max_sq;
+
+            if (!(fabsf(r_sq - r_max_sq) > 32 * eps * (reach * reach + r_max_sq))){  // Too close to call in float (or NaN): redo in double
+                double c_d = c;
+                double t_d = z * sqrt((1 - c_d) * (1 + c_d)) / c_d;
+                double x_d = (double) r_source[i] * cos((double) phi_source[i]) + config.offset_x + t_d * cos((double) phi_emission[i]);
+                double y_d = (double) r_source[i] * sin((double) phi_source[i]) + config.offset_y + t_d * sin((double) phi_emission[i]);
+                hit = x_d * x_d + y_d * y_d <= (double) radius * radius;
+            }
+
+            if (hit){
+                counts.N_hit++;                                             // Add 1 to hit counter
+
+                if (config.derivatives){
+                    add_hit_scores(counts, config, z, dx, dy, (double) r_source[i] * cos((double) phi_source[i]), (double) r_source[i] * sin((double) phi_source[i]));
+                }
+            }
+        }
+    }
+    PROFILE_PHASE(profile_none);
+    PROFILE_COUNT(hits, counts.N_hit);
+    return counts;
+}
+
+
+// Hits on a circle of the given radius in a tilted detector plane through (0, 0, z) with normal n, see detector_normal.
+// Every ray is intersected with the plane: from source point s along direction d the ray meets it at t = n.(c - s) / n.d, and
+// hits if t > 0 and |s + t d - c| <= radius (the intersection lies in the plane, so this is the distance to the centre in the
+// plane). Backward rays are folded forward with sign(cos(theta)) like the z tan(theta) projection of generate_isotropic does,
+// so at zero tilt this is the same calculation as count_hits. The loop has no data-dependent branch except the hit itself.
+// Same random draws as count_hits.
+point_counts count_hits_tilted(const geo_config& config, double z, double radius, long long first, long long last){
+    point_counts counts;                                                    // Initialize hit counter
+    counts.n = last - first;
+    double n_x, n_y, n_z;
+    detector_normal(config, n_x, n_y, n_z);
+    const double r_max_sq = radius * radius;
+
+    for (long long stream = first / STREAM_SIZE; stream * STREAM_SIZE < last; stream++){
+        int begin = std::max(first - stream * STREAM_SIZE, 0LL);            // Range of this stream still to be counted
+        int n = std::min(last - stream * STREAM_SIZE, (long long) STREAM_SIZE);
+        int stream_seed = config.seed + 2 * stream;
+        PROFILE_PHASE(profile_copies);
+        PROFILE_COUNT(samples, n);
+        PROFILE_COUNT(buffer_bytes, 4 * sizeof(double) * n);
+        std::vector<double> x1(n), y1(n), phi_emission(n), cos_theta(n);
+        position generate_source(x1, y1);
+
+        PROFILE_PHASE(profile_source);
+        generate_source_distr(config, generate_source, stream_seed);        // Generate source position
+
+        PROFILE_PHASE(profile_emission);
+        std::default_random_engine emission_generator{(unsigned long) stream_seed + 1};
+        std::uniform_real_distribution<double> phi_distr(0, 2*pi);
+        std::uniform_real_distribution<double> unit_distr(0, 1);
+        for (int i = 0; i < n; i++){                                        // Same draws as generate_isotropic
+            phi_emission[i] = phi_distr(emission_generator);
+            cos_theta[i] = 1 - 2 * unit_distr(emission_generator);
+        }
+        std::vector<double> depth = sample_depths(config, stream, n);
+
+        // Intersect and check if it was a hit or a miss
+        PROFILE_PHASE(profile_hit_test);
+        for (int i = begin; i < n; i++){
+            double z_i = depth.empty() ? z : z + depth[i];                 // The source point lies at depth below z = 0
+            double c = cos_theta[i];
+            double sin_theta = copysign(sqrt((1 - c) * (1 + c)), c);       // Folded direction (sign(c) sin, sign(c) sin, |c|)
+            double d_x = sin_theta * cos(phi_emission[i]), d_y = sin_theta * sin(phi_emission[i]), d_z = fabs(c);
+            double w_x = -generate_source.x[i] - config.offset_x, w_y = -generate_source.y[i] - config.offset_y;  // c - s
+            double t = (n_x * w_x + n_y * w_y + n_z * z_i) / (n_x * d_x + n_y * d_y + n_z * d_z);
+            double p_x = t * d_x - w_x, p_y = t * d_y - w_y, p_z = t * d_z - z_i;
+            counts.N_hit += (t > 0) & (p_x * p_x + p_y * p_y + p_z * p_z <= r_max_sq);
+        }
+    }
+    PROFILE_PHASE(profile_none);
+    PROFILE_COUNT(hits, counts.N_hit);
+    return counts;
+}
+
+
+// Count the hits on a rectangular detector spanning [-1, 1] x [-det_height, det_height] among samples [first, last), and per pixel
+// of its pixels_x x pixels_y grid in pixel_hits (index iy * pixels_x + ix). The pixel of a hit follows from its coordinates
+// by integer truncation, so the cost does not depend on the number of pixels. Same samples, scores and landing histogram as count_hits.
+point_counts count_hits_grid(const geo_config& config, double z, long long first, long long last, std::vector<long long>& pixel_hits,
+                             sample_histograms* histograms = nullptr){
+    point_counts counts;                                                    // Initialize hit counter
+    counts.n = last - first;
+    const double scale_x = config.pixels_x / 2.0, scale_y = config.pixels_y / (2 * config.det_height);
+    const landing_grid grid = histogram_grid(config);
+
+    for (long long stream = first / STREAM_SIZE; stream * STREAM_SIZE < last; stream++){
+        int begin = std::max(first - stream * STREAM_SIZE, 0LL);            // Range of this stream still to be counted
+        int n = std::min(last - stream * STREAM_SIZE, (long long) STREAM_SIZE);
+        std::vector<double> x1(n), x2(n), y1(n), y2(n);
+
+        position generate_source(x1, y1);
+        position generate_emission(x2, y2);
+        std::vector<double> depth;
+        sample_stream(config, z, stream, generate_source, generate_emission, depth);
+
+        // Check if it was a hit or a miss, and on which pixel
+        PROFILE_PHASE(profile_hit_test);
+        std::vector<int> survivors = aperture_survivors(config, z, generate_source, generate_emission, depth, begin, n);
+        if (histograms){
+            histograms->add(survivors, config, grid, generate_source);
+        }
+        for (int i : survivors){
+            double u = (generate_source.x[i] + 1) * scale_x;               // Position in pixel units from the lower left corner
+            double v = (generate_source.y[i] + config.det_height) * scale_y;
+            if (u >= 0 && u < config.pixels_x && v >= 0 && v < config.pixels_y){
+                int ix = std::min((int) u, config.pixels_x - 1), iy = std::min((int) v, config.pixels_y - 1);
+                pixel_hits[iy * config.pixels_x + ix]++;
+                counts.N_hit++;                                             // Add 1 to hit counter
+                double z_i = depth.empty() ? z : z + depth[i];             // Distance travelled to the detector plane
+
+                if (config.derivatives){
+                    double dx = generate_emission.x[i], dy = generate_emission.y[i];
+                    add_hit_scores(counts, config, z_i, dx, dy, generate_source.x[i] - dx - config.offset_x, generate_source.y[i] - dy - config.offset_y);
+                }
+            }
+        }
+    }
+    PROFILE_PHASE(profile_none);
+    PROFILE_COUNT(hits, counts.N_hit);
+    return counts;
+}
+
+
+// Full description of a single circle calculation; every input that changes the sampled counts has to be part of it
+std::string point_key(const geo_config& config, double z, double radius){
+    std::ostringstream key;
+    key << "engine=" << ENGINE_VERSION << ";stream_size=" << STREAM_SIZE << ";source_type=" << config.source_type
+        << ";detector=circle;radius=" << exact_str(radius) << ";z=" << exact_str(z) << ";source=" << exact_str(config.source) << ";seed=" << config.seed;
+    if (config.source_type == "map"){
+        const source_map& map = load_source_map(config.source_map_file, config.map_x, config.map_y, config.map_pixel);
+        char map_hash[17];
+        snprintf(map_hash, sizeof(map_hash), "%016llx", (unsigned long long) map.content_hash);
+        key << ";map=" << map_hash << "," << config.map_x << "x" << config.map_y << "," << exact_str(config.map_pixel);
+    }
+    if (config.offset_x != 0 || config.offset_y != 0){
+        key << ";offset=" << exact_str(config.offset_x) << "," << exact_str(config.offset_y);
+    }
+    if (config.emission != ""){
+        char emission_hash[17];
+        snprintf(emission_hash, sizeof(emission_hash), "%016llx", (unsigned long long) load_emission_model(config.emission).content_hash);
+        key << ";emission=" << emission_hash << (config.emission_weighted ? ",weighted" : ",inverse_cdf");
+    }
+    if (config.depth != ""){
+        char depth_hash[17];
+        snprintf(depth_hash, sizeof(depth_hash), "%016llx", (unsigned long long) load_depth_model(config.depth).content_hash);
+        key << ";depth=" << depth_hash;
+    }
+    if (!config.apertures.empty()){
+        key << ";apertures=" << apertures_str(config.apertures);
+    }
+    if (config.tilt != 0){
+        key << ";tilt=" << exact_str(config.tilt) << "," << exact_str(config.tilt_azimuth);
+    }
+    if (config.derivatives){
+        key << ";scores=1";
+    }
+    if (config.single_precision){
+        key << ";precision=float";
+    }
+    return key.str();
+}
+
+
+// Cache entry file of a point key: <cache_dir>/<hash>.txt
+std::string cache_path(std::string cache_dir, std::string key){
+    char name[17];
+    snprintf(name, sizeof(name), "%016llx", (unsigned long long) fnv1a_hash(key));
+    return cache_dir + "/" + name + ".txt";
+}
+
+
+// Read a cache entry; returns the stored counts, or zero counts if the entry is missing or belongs to another key
+point_counts read_cache(std::string cache_dir, std::string key){
+    PROFILE_SCOPE(profile_io);
+    point_counts counts;
+    std::ifstream entry(cache_path(cache_dir, key));
+    std::string stored_key;
+
+    if (entry && std::getline(entry, stored_key) && stored_key == key){
+        if (!(entry >> counts.N_hit >> counts.n) || !read_stats(entry, counts.score_z) || !read_stats(entry, counts.score_source)
+            || !read_stats(entry, counts.weight)){
+            counts = point_counts();
+        }
+    }
+    return counts;
+}
+
+
+// Write a cache entry through a temporary file and a rename, so concurrent readers never see a partial entry
+void write_cache(std::string cache_dir, std::string key, point_counts counts){
+    PROFILE_SCOPE(profile_io);
+    mkdir(cache_dir.c_str(), 0755);
+    std::string path = cache_path(cache_dir, key);
+    std::string temp_path = path + "." + std::to_string(getpid()) + "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + ".tmp";
+    std::ofstream entry(temp_path);
+    entry << key << "\n" << counts.N_hit << "\t" << counts.n << "\t" << stats_str(counts.score_z) << "\t" << stats_str(counts.score_source)
+          << "\t" << stats_str(counts.weight) << "\n";
+    entry.close();
+
+    if (!entry || rename(temp_path.c_str(), path.c_str()) != 0){
+        std::cerr << "WARNING: could not write cache entry " << path << std::endl;
+        remove(temp_path.c_str());
+    }
+}
+
+
+// Raw hit counts on a circle at a specific distance using at least n samples, continuing from the counts of an earlier run if given.
+// With a cache directory, a cached entry for the same configuration is used and, if it has fewer than n samples, extended
+// with the next unused samples and written back.
+point_counts geom_counts_point(const geo_config& config, double z, double radius, long long n, std::string cache_dir = "", point_counts previous = point_counts()){
+    point_counts counts = previous;
+    std::string key;
+
+    if (cache_dir != ""){
+        key = point_key(config, z, radius);
+        point_counts cached = read_cache(cache_dir, key);
+        if (cached.n > counts.n){                                           // Both cover the samples [0, n), the longer one contains the other
+            counts = cached;
+        }
+    }
+    if (counts.n < n){
+        counts.add(count_hits(config, z, radius, counts.n, n));
+        if (cache_dir != ""){
+            write_cache(cache_dir, key, counts);
+        }
+    }
+    return counts;
+}
+
+
+// Results of a run: the grid and the raw counts per distance (annular detector: outer and inner circle; rectangular and
+// pixelated detectors: the whole rectangle in outer, and for pixelated detectors the hits per pixel in pixel_hits).
+// The sample count n of a point is also its RNG position, the next run continues with sample n.
+struct geo_results {
+    geo_config config;
+    std::vector<double> z;
+    std::vector<point_counts> outer, inner;
+    std::vector<std::vector<long long>> pixel_hits;
+    std::vector<std::vector<long long>> landing_hits;                       // Landing histogram per distance, with '--landing'
+    std::vector<std::vector<long long>> radial_hits;                        // Radial histogram per distance, with '--radial'
+};
+
+
+// Check for the detector types that are sampled with count_hits_grid
+bool grid_detector(const geo_config& config){
+    return config.detector_type == "rectangular" || config.detector_type == "pixelated";
+}
+
+
+// Check a configuration and its distances before anything is sampled: returns "" if they can be run, otherwise what is wrong.
+// Runs started from main and queries to the server go through the same checks.
+std::string validate_config(const geo_config& config, const std::vector<double>& z){
+    std::ostringstream error;
+    bool histograms = config.landing_bins > 0 || config.radial_bins > 0;
+
+    if (config.source_type != "map" && !(config.source >= 0)){
+        error << "source/rd = " << config.source << " is negative; use source/rd >= 0";
+    } else if (config.detector_type == "annular" && !(config.det_fraction > 1)){
+        error << "detector outer/inner = " << config.det_fraction << " leaves no ring; use outer/inner > 1";
+    } else if (grid_detector(config) && !(config.det_height > 0)){
+        error << "detector height/width = " << config.det_height << " leaves no detector; use height/width > 0";
+    } else if (config.detector_type == "pixelated" && (config.pixels_x < 1 || config.pixels_y < 1)){
+        error << "a pixelated detector needs at least one pixel in x and y";
+    } else if (config.tilt != 0 && (config.single_precision || config.derivatives || grid_detector(config))){
+        error << "a tilted detector is only available for circular and annular detectors, without '--float' and '--derivatives'";
+    } else if (config.emission != "" && (config.single_precision || config.derivatives || config.tilt != 0)){
+        error << "anisotropic emission cannot be combined with '--float', '--derivatives' or '--tilt'";
+    } else if (config.emission_weighted && grid_detector(config)){
+        error << "'--weighted' is only available for circular and annular detectors";
+    } else if (config.depth != "" && config.single_precision){
+        error << "a depth profile cannot be combined with '--float'";
+    } else if (!config.apertures.empty() && (config.single_precision || config.derivatives || config.tilt != 0)){
+        error << "apertures cannot be combined with '--float', '--derivatives' or '--tilt'";
+    } else if (config.source_type == "map" && (config.single_precision || config.derivatives)){
+        error << "a map source cannot be combined with '--float' or '--derivatives'";
+    } else if (grid_detector(config) && config.single_precision){
+        error << "'--float' is only available for circular and annular detectors";
+    } else if (histograms && (config.single_precision || config.tilt != 0 || config.emission_weighted)){
+        error << "landing and radial histograms cannot be combined with '--float', '--tilt' or '--weighted'";
+    }
+    if (error.tellp() > 0){
+        return error.str();
+    }
+
+    for (double z_point : z){
+        if (config.tilt != 0 && z_point <= fabs(sin(config.tilt * pi / 180))){  // The folded emission only covers detectors in front of the source
+            error << "at z/rd = " << z_point << " the tilted detector reaches the source plane; use z/rd > " << fabs(sin(config.tilt * pi / 180));
+            return error.str();
+        } else if (!(z_point >= 0)){
+            error << "z/rd = " << z_point << " is behind the source; use z/rd >= 0";
+            return error.str();
+        } else if (config.derivatives && z_point == 0){                    // The z score 1/z - 3z/(z^2 + d^2) has no limit there
+            error << "'--derivatives' needs z/rd > 0, the likelihood-ratio scores are undefined at z/rd = 0";
+            return error.str();
+        }
+        for (const aperture& a : config.apertures){
+            if (a.z >= z_point){
+                error << "the aperture at z/rd = " << a.z << " is not between the source and the detector at z/rd = " << z_point;
+                return error.str();
+            }
+        }
+    }
+    return "";
+}
+
+
+// Sample the point i of a run up to n samples, continuing from the counts it already has.
+// Sampling goes one RNG stream at a time and calls progress after each stream, so long points can be checkpointed.
+// A shard only samples its own streams of [0, n); its counts hold those samples only and are never cached.
+// Rectangular and pixelated detectors are never cached either, their pixel maps do not fit a cache entry, and neither are runs
+// with a landing histogram. The counts and maps of a point are private to its thread until they are stored in results.
+// When other threads read the results meanwhile, the counts are stored under results_mutex.
+void run_point(geo_results& results, int i, long long n, std::string cache_dir, std::function<void()> progress = nullptr, std::mutex* results_mutex = nullptr){
+    const geo_config& config = results.config;
+    bool annular = config.detector_type == "annular", grid = grid_detector(config);
+    bool histogram = config.landing_bins > 0 || config.radial_bins > 0;
+    double radius_inner = 1 / config.det_fraction;                          // Inner circle in units of the outer radius
+    point_counts outer = results.outer[i], inner = results.inner[i];
+    std::vector<long long> pixels(config.pixels_x * config.pixels_y, 0);
+    if (config.detector_type == "pixelated"){
+        pixels = results.pixel_hits[i];
+    }
+    sample_histograms histograms;
+    if (config.landing_bins > 0){
+        histograms.landing = results.landing_hits[i];
+    }
+    if (config.radial_bins > 0){
+        histograms.radial = results.radial_hits[i];
+    }
+
+    while (true){
+        long long done = annular ? std::min(outer.n, inner.n) : outer.n;
+
+        if (config.n_shards > 1 || grid || histogram){
+            long long stream = config.shard + config.n_shards * (done / STREAM_SIZE);    // Every earlier stream of the shard is complete
+            long long first = stream * STREAM_SIZE + done % STREAM_SIZE;
+            long long last = std::min(n, (stream + 1) * STREAM_SIZE);
+            if (first >= last){
+                break;
+            }
+            if (grid){
+                outer.add(count_hits_grid(config, results.z[i], first, last, pixels, histogram ? &histograms : nullptr));
+            } else{
+                outer.add(count_hits(config, results.z[i], 1, first, last, histogram ? &histograms : nullptr));
+            }
+            if (annular){
+                inner.add(count_hits(config, results.z[i], radius_inner, first, last));
+            }
+        } else{
+            if (done >= n){
+                break;
+            }
+            long long next = std::min(n, (done / STREAM_SIZE + 1) * STREAM_SIZE);
+            outer = geom_counts_point(config, results.z[i], 1, next, cache_dir, outer);
+            if (annular){
+                inner = geom_counts_point(config, results.z[i], radius_inner, next, cache_dir, inner);
+            }
+            if (annular && outer.n != inner.n){                             // A cached circle may hold more samples than asked for:
+                long long longest = std::max(outer.n, inner.n);             // top up the other one so both end at the same n
+                outer = geom_counts_point(config, results.z[i], 1, longest, cache_dir, outer);
+                inner = geom_counts_point(config, results.z[i], radius_inner, longest, cache_dir, inner);
+            }
+        }
+
+        {
+            std::unique_lock<std::mutex> lock;
+            if (results_mutex){
+                lock = std::unique_lock<std::mutex>(*results_mutex);
+            }
+            results.outer[i] = outer;
+            results.inner[i] = inner;
+            if (config.detector_type == "pixelated"){
+                results.pixel_hits[i] = pixels;
+            }
+            if (config.landing_bins > 0){
+                results.landing_hits[i] = histograms.landing;
+            }
+            if (config.radial_bins > 0){
+                results.radial_hits[i] = histograms.radial;
+            }
+        }
+        if (progress){
+            progress();
+        }
+    }
+}
+
+
+// Binomial relative error (%) of N_hit hits out of n samples (infinite without hits, see binomial_interval)
+double binomial_rel_er(point_counts counts){
+    double p = 1.0*counts.N_hit/counts.n;
+    return 100 * sqrt((1 - p) / counts.N_hit);
+}
+
+
+// Continued fraction of the incomplete beta function (modified Lentz), converges fast for x < (a + 1) / (a + b + 2)
+double beta_continued_fraction(double a, double b, double x){
+    const double tiny = 1e-300, eps = 1e-15;
+    double c = 1, d = 1 - (a + b) * x / (a + 1);
+    d = 1 / (fabs(d) < tiny ? tiny : d);
+    double h = d;
+
+    for (long long m = 1; m < 100000000; m++){
+        for (int step = 0; step < 2; step++){                                // Even and odd terms of the fraction
+            double coefficient = step == 0 ? m * (b - m) * x / ((a + 2 * m - 1) * (a + 2 * m))
+                                           : -(a + m) * (a + b + m) * x / ((a + 2 * m) * (a + 2 * m + 1));
+            d = 1 + coefficient * d;
+            d = 1 / (fabs(d) < tiny ? tiny : d);
+            c = 1 + coefficient / c;
+            c = fabs(c) < tiny ? tiny : c;
+            h *= d * c;
+            if (step == 1 && fabs(d * c - 1) < eps){
+                return h;
+            }
+        }
+    }
+    return h;
+}
+
+
+// Regularized incomplete beta function I_x(a, b)
+double incomplete_beta(double a, double b, double x){
+    if (x <= 0){
+        return 0;
+    }
+    if (x >= 1){
+        return 1;
+    }
+    double log_front = lgamma(a + b) - lgamma(a) - lgamma(b) + a * log(x) + b * log1p(-x);
+    if (x < (a + 1) / (a + b + 2)){
+        return exp(log_front) * beta_continued_fraction(a, b, x) / a;
+    }
+    return 1 - exp(log_front) * beta_continued_fraction(b, a, 1 - x) / b;
+}
+
+
+// Two-sided standard normal quantile: the z with P(|Z| > z) = alpha (bisection on erfc)
+double normal_quantile(double alpha){
+    double below = 0, above = 40;
+    for (int iteration = 0; iteration < 200; iteration++){
+        double middle = (below + above) / 2;
+        if (middle <= below || middle >= above){
+            break;
+        }
+        (std::erfc(middle / sqrt(2.0)) > alpha ? below : above) = middle;
+    }
+    return (below + above) / 2;
+}
+
+
+// Two-sided 1 - alpha (default 95%) confidence interval for a binomial proportion with k successes out of n trials: the Wilson
+// score interval or, with clopper_pearson, the exact Clopper-Pearson interval (bisection on the binomial tails). Both stay
+// inside [0, 1] and are finite at k = 0 and k = n, where the relative error is not.
+void binomial_interval(long long k, long long n, bool clopper_pearson, double& lower, double& upper, double alpha = 0.05){
+    const double z = alpha == 0.05 ? 1.959963984540054 : normal_quantile(alpha);
+    if (n <= 0){
+        lower = 0;
+        upper = 1;
+        return;
+    }
+    double p = 1.0 * k / n;
+
+    if (!clopper_pearson){
+        double centre = (p + z * z / (2 * n)) / (1 + z * z / n);
+        double half_width = z / (1 + z * z / n) * sqrt(p * (1 - p) / n + z * z / (4.0 * n * n));
+        lower = k == 0 ? 0 : std::max(centre - half_width, 0.0);
+        upper = k == n ? 1 : std::min(centre + half_width, 1.0);
+        return;
+    }
+
+    // Lower end: P(X >= k | q) = I_q(k, n - k + 1) = alpha / 2; upper end: P(X <= k | q) = 1 - I_q(k + 1, n - k) = alpha / 2
+    auto solve = [](std::function<double(double)> tail, double below, double above){
+        for (int iteration = 0; iteration < 200 && below < above; iteration++){
+            double middle = (below + above) / 2;
+            if (middle <= below || middle >= above){
+                break;
+            }
+            (tail(middle) < 0 ? below : above) = middle;
+        }
+        return (below + above) / 2;
+    };
+    lower = k == 0 ? 0 : solve([&](double q){ return incomplete_beta(k, n - k + 1, q) - alpha / 2; }, 0, p);
+    upper = k == n ? 1 : solve([&](double q){ return alpha / 2 - (1 - incomplete_beta(k + 1, n - k, q)); }, p, 1);
+}
+
+
+// Efficiency (%) per hit per sample: 100 times the share of the emission that is sampled, the forward hemisphere
+double hit_factor(const geo_config& config){
+    if (config.emission != "" && !config.emission_weighted){
+        return 100 * load_emission_model(config.emission).forward_fraction;
+    }
+    return 50.0;
+}
+
+
+// Efficiency and relative error (%) of point i from its raw counts
+void point_result(const geo_results& results, int i, double& efficiency, double& rel_er){
+    const point_counts& outer = results.outer[i];
+    double factor = hit_factor(results.config);
+
+    if (results.config.emission_weighted){                                 // Weighted emission: mean of 50 W / <W> over all samples
+        running_stats ring = outer.weight;
+        if (results.config.detector_type == "annular"){                     // Inner hits are a subset of the outer hits
+            ring.remove(results.inner[i].weight);
+        }
+        double mean, error;
+        ring.over_samples(outer.n, mean, error);
+        efficiency = factor * mean;
+        rel_er = mean > 0 ? 100 * error / mean : INFINITY;
+        return;
+    }
+
+    double efficiency_outer = factor*outer.N_hit/outer.n;
+    double rel_er_outer = binomial_rel_er(outer);
+
+    if (results.config.detector_type == "annular"){
+        // Inner circle, ring and miss are the outcomes of a multinomial: the inner hits are outer hits as well, so the two
+        // counts are correlated over the samples they share. With equal sample counts this is the binomial p(1 - p)/n of the ring.
+        const point_counts& inner = results.inner[i];
+        double p_outer = 1.0 * outer.N_hit / outer.n, p_inner = 1.0 * inner.N_hit / inner.n;
+        double variance = p_outer * (1 - p_outer) / outer.n + p_inner * (1 - p_inner) / inner.n
+                          - 2 * p_inner * (1 - p_outer) * std::min(outer.n, inner.n) / (1.0 * outer.n * inner.n);
+        efficiency = factor * (p_outer - p_inner);
+        rel_er = p_outer > p_inner ? 100 * sqrt(std::max(variance, 0.0)) / (p_outer - p_inner) : INFINITY;
+    } else{
+        efficiency = efficiency_outer;
+        rel_er = rel_er_outer;
+    }
+}
+
+
+// 95% confidence interval (%) of the efficiency of point i from its raw counts, see binomial_interval. For an annular detector
+// with equal sample counts the ring hits N_hit - N_hit inner are binomial themselves; weighted emission and annular points
+// with unequal sample counts get the normal interval of point_result.
+void point_interval(const geo_results& results, int i, double& lower, double& upper){
+    const geo_config& config = results.config;
+    const point_counts& outer = results.outer[i];
+    const point_counts& inner = results.inner[i];
+    bool annular = config.detector_type == "annular";
+    double factor = hit_factor(config);
+
+    if (config.emission_weighted || (annular && inner.n != outer.n)){
+        double efficiency, rel_er;
+        point_result(results, i, efficiency, rel_er);
+        double error = std::isfinite(rel_er) ? efficiency * rel_er / 100 : 0;
+        lower = std::max(efficiency - 1.959963984540054 * error, 0.0);
+        upper = efficiency + 1.959963984540054 * error;
+        return;
+    }
+    binomial_interval(annular ? outer.N_hit - inner.N_hit : outer.N_hit, outer.n, config.interval == "clopper-pearson", lower, upper);
+    lower *= factor;
+    upper *= factor;
+}
+
+
+// Effective sample size of weighted emission at point i: the number of equally weighted samples with the same relative error
+// (Kish), over the hits of the circle or ring
+double point_effective_samples(const geo_results& results, int i){
+    running_stats ring = results.outer[i].weight;
+    if (results.config.detector_type == "annular"){
+        ring.remove(results.inner[i].weight);
+    }
+    return ring.effective_samples();
+}
+
+
+// Derivatives of the efficiency (%) of point i with respect to z/rd and source/rd, with their errors.
+// The isotropic emission lands at displacement d from the source with density z / (2 pi (z^2 + |d|^2)^(3/2)), and the source is
+// a scale family x = source * xi. Differentiating that density instead of the hit indicator gives per-hit scores
+//   dE/dz:      1/z - 3 z / (z^2 + |d|^2)
+//   dE/dsource: 3 (xi . d) / (z^2 + |d|^2)
+// whose mean over all samples (misses score 0) times 50 is an unbiased derivative estimate from the same samples.
+// The inner circle of an annulus sees a subset of the hits with the same scores, so the inner mean is subtracted, each circle
+// over its own samples. On the samples both circles share the scores are equal, which gives the covariance of the two means.
+void point_derivatives(const geo_results& results, int i, double& dE_dz, double& dE_dz_er, double& dE_dsource, double& dE_dsource_er){
+    const point_counts& outer = results.outer[i];
+    const point_counts& inner = results.inner[i];
+    bool annular = results.config.detector_type == "annular" && inner.n > 0;
+
+    auto mean_and_error = [&](const running_stats& outer_scores, const running_stats& inner_scores, double& value, double& error){
+        double mean_outer, error_outer, mean_inner = 0, error_inner = 0, covariance = 0;
+        outer_scores.over_samples(outer.n, mean_outer, error_outer);
+        if (annular){
+            inner_scores.over_samples(inner.n, mean_inner, error_inner);
+            covariance = (inner_scores.sum_sq() / inner.n - mean_outer * mean_inner) * std::min(outer.n, inner.n) / (1.0 * outer.n * inner.n);
+        }
+        value = 50 * (mean_outer - mean_inner);
+        error = 50 * sqrt(std::max(error_outer * error_outer + error_inner * error_inner - 2 * covariance, 0.0));
+    };
+    mean_and_error(outer.score_z, inner.score_z, dE_dz, dE_dz_er);
+    mean_and_error(outer.score_source, inner.score_source, dE_dsource, dE_dsource_er);
+}
+
+
+// Binary table format, all numbers in native (little-endian) byte order:
+//   8 bytes      magic "GEOTAB\0\0"
+//   uint32       format version (GEOTAB_VERSION)
+//   uint32       header length in bytes, padded with zeros to a multiple of 8
+//   header       key=value lines; 'axes', 'shape' and 'arrays' give the layout, all other keys are run parameters
+//   float64      coordinates of every axis, in header order
+//   float64      every array over the full grid (row-major, first axis slowest), in header order
+// All data starts 8-byte aligned so the file can be mapped and used in place.
+struct geo_table {
+    std::map<std::string, std::string> params;
+    std::vector<std::string> axis_names, array_names;
+    std::vector<std::vector<double>> axes, arrays;
+};
+
+
+// Write a table in the binary format, through a temporary file and a rename so readers that map the old file keep a
+// complete table
+void write_geo_table(const geo_table& table, std::string filename){
+    std::ostringstream header;
+    std::vector<std::string> shape;
+    size_t grid_size = 1;
+
+    for (int i = 0; i < table.axes.size(); i++){
+        shape.push_back(std::to_string(table.axes[i].size()));
+        grid_size *= table.axes[i].size();
+    }
+    for (int i = 0; i < table.arrays.size(); i++){
+        if (table.arrays[i].size() != grid_size){
+            std::cerr << "ERROR: table array '" << table.array_names[i] << "' does not match the grid size" << std::endl;
+            exit(0);
+        }
+    }
+
+    header << "axes=" << join(table.axis_names, ',') << "\n";
+    header << "shape=" << join(shape, ',') << "\n";
+    header << "arrays=" << join(table.array_names, ',') << "\n";
+    for (auto const& param : table.params){
+        header << param.first << "=" << param.second << "\n";
+    }
+    std::string header_text = header.str();
+    header_text.resize((header_text.size() + 7) / 8 * 8, '\0');
+
+    char magic[8] = {'G', 'E', 'O', 'T', 'A', 'B', 0, 0};
+    uint32_t version = GEOTAB_VERSION;
+    uint32_t header_length = header_text.size();
+    std::string temp_path = filename + "." + std::to_string(getpid()) + ".tmp";
+    std::ofstream myFile(temp_path, std::ios::binary);
+    myFile.write(magic, 8);
+    myFile.write((const char*) &version, 4);
+    myFile.write((const char*) &header_length, 4);
+    myFile.write(header_text.data(), header_length);
+
+    for (int i = 0; i < table.axes.size(); i++){
+        myFile.write((const char*) table.axes[i].data(), table.axes[i].size() * sizeof(double));
+    }
+    for (int i = 0; i < table.arrays.size(); i++){
+        myFile.write((const char*) table.arrays[i].data(), grid_size * sizeof(double));
+    }
+
+    myFile.close();
+    if (!myFile || rename(temp_path.c_str(), filename.c_str()) != 0){
+        std::cerr << "ERROR: could not write table file " << filename << std::endl;
+        remove(temp_path.c_str());
+        exit(0);
+    }
+}
+
+
+// Read-only view of a binary table: the file is memory mapped (shared between processes) and the arrays point into the mapping
+class geo_table_view {
+    public:
+        std::map<std::string, std::string> params;
+        std::vector<std::string> axis_names, array_names;
+        std::vector<size_t> shape;
+        std::vector<const double*> axes, arrays;
+        size_t grid_size = 1;
+
+        geo_table_view(std::string filename){                                                      // Constructor: map the file and check the layout
+            int fd = open(filename.c_str(), O_RDONLY);
+            struct stat info;
+            if (fd < 0 || fstat(fd, &info) != 0){
+                std::cerr << "ERROR: could not open table file " << filename << std::endl;
+                exit(0);
+            }
+            mapped_size = info.st_size;
+            mapped = mapped_size > 0 ? mmap(nullptr, mapped_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+            close(fd);
+
+            if (mapped == MAP_FAILED || mapped_size < 16 || memcmp(mapped, "GEOTAB\0\0", 8) != 0){
+                std::cerr << "ERROR: " << filename << " is not a binary table file" << std::endl;
+                exit(0);
+            }
+
+            const char* bytes = (const char*) mapped;
+            uint32_t version, header_length;
+            memcpy(&version, bytes + 8, 4);
+            memcpy(&header_length, bytes + 12, 4);
+            if (version != GEOTAB_VERSION || 16 + (size_t) header_length > mapped_size){
+                std::cerr << "ERROR: unsupported table version " << version << " in " << filename << std::endl;
+                exit(0);
+            }
+
+            std::string header_text(bytes + 16, strnlen(bytes + 16, header_length));
+            for (std::string line : split(header_text, '\n')){
+                size_t eq = line.find('=');
+                if (eq != std::string::npos){
+                    params[line.substr(0, eq)] = line.substr(eq + 1);
+                }
+            }
+            axis_names = split(params["axes"], ',');
+            array_names = split(params["arrays"], ',');
+            for (std::string length : split(params["shape"], ',')){
+                shape.push_back(std::stoull(length));
+                grid_size *= shape.back();
+            }
+            params.erase("axes");
+            params.erase("shape");
+            params.erase("arrays");
+
+            size_t offset = 16 + header_length;
+            size_t needed = offset;
+            for (size_t length : shape){
+                needed += length * sizeof(double);
+            }
+            needed += array_names.size() * grid_size * sizeof(double);
+            if (shape.size() != axis_names.size() || needed > mapped_size){
+                std::cerr << "ERROR: truncated or inconsistent table file " << filename << std::endl;
+                exit(0);
+            }
+
+            for (size_t length : shape){
+                axes.push_back((const double*) (bytes + offset));
+                offset += length * sizeof(double);
+            }
+            for (int i = 0; i < array_names.size(); i++){
+                arrays.push_back((const double*) (bytes + offset));
+                offset += grid_size * sizeof(double);
+            }
+        }
+
+        ~geo_table_view(){                                                                          // Destructor: release the mapping
+            munmap(mapped, mapped_size);
+        }
+
+        geo_table_view(const geo_table_view&) = delete;
+        geo_table_view& operator=(const geo_table_view&) = delete;
+
+        const double* array(std::string name){                                                      // Pointer to a named array, nullptr if absent
+            for (int i = 0; i < array_names.size(); i++){
+                if (array_names[i] == name){
+                    return arrays[i];
+                }
+            }
+            return nullptr;
+        }
+
+        // Linearly interpolate a named array of a 1D table at coordinate x (NaN outside the grid)
+        double lookup(double x, std::string name = "value"){
+            const double* values = array(name);
+            if (values == nullptr || shape.size() != 1 || shape[0] == 0){
+                return NAN;
+            }
+
+            const double* axis = axes[0];
+            size_t size = shape[0];
+            bool ascending = axis[size - 1] >= axis[0];
+            double lo = ascending ? axis[0] : axis[size - 1];
+            double hi = ascending ? axis[size - 1] : axis[0];
+            if (x < lo || x > hi){
+                return NAN;
+            }
+            if (size == 1){
+                return values[0];
+            }
+
+            size_t i = ascending ? std::upper_bound(axis, axis + size, x) - axis : std::upper_bound(axis, axis + size, x, std::greater<double>()) - axis;
+            i = std::min(std::max(i, (size_t) 1), size - 1);
+            double t = (x - axis[i - 1]) / (axis[i] - axis[i - 1]);
+            return values[i - 1] + t * (values[i] - values[i - 1]);
+        }
+
+    private:
+        void* mapped;
+        size_t mapped_size;
+};
+
+
+// Column names of the text output
+std::string result_columns(const geo_config& config){
+    std::string columns = "z/rd \t point source \t Model \t Relative uncertainty \t N_hit \t N_hit inner \t Samples \t Samples inner";
+    if (config.derivatives){
+        columns += " \t dE/dz \t dE/dz error \t dE/dsource \t dE/dsource error";
+    }
+    if (config.emission_weighted){
+        columns += " \t Effective samples";
+    }
+    return columns + " \t 95% lower \t 95% upper \n";
+}
+
+
+// One row of the text output for point i
+std::string result_row(const geo_results& results, int i){
+    std::ostringstream row;
+    double efficiency, rel_er;
+
+    point_result(results, i, efficiency, rel_er);
+    row << exact_str(results.z[i]) << "\t" << detector_point_source(results.config, {results.z[i]})[0] << "\t" << efficiency << "\t" << rel_er << "\t"
+        << results.outer[i].N_hit << "\t" << results.inner[i].N_hit << "\t" << results.outer[i].n << "\t" << results.inner[i].n;
+    if (results.config.derivatives){
+        double dE_dz, dE_dz_er, dE_dsource, dE_dsource_er;
+        point_derivatives(results, i, dE_dz, dE_dz_er, dE_dsource, dE_dsource_er);
+        row << "\t" << dE_dz << "\t" << dE_dz_er << "\t" << dE_dsource << "\t" << dE_dsource_er;
+    }
+    if (results.config.emission_weighted){
+        row << "\t" << point_effective_samples(results, i);
+    }
+    double lower, upper;
+    point_interval(results, i, lower, upper);
+    row << "\t" << lower << "\t" << upper << "\n";
+    return row.str();
+}
+
+
+// Map file of the given kind that goes with an output file: x.gtab or x.txt -> x.<kind>.gtab or x.txt.<kind>.gtab
+std::string map_path(std::string filename, std::string kind){
+    if (ends_with(filename, ".gtab")){
+        filename.resize(filename.size() - 5);
+    }
+    return filename + "." + kind + ".gtab";
+}
+
+
+// Pixel map file that goes with an output file
+std::string pixel_map_path(std::string filename){
+    return map_path(filename, "pixels");
+}
+
+
+// Landing histogram file that goes with an output file
+std::string landing_map_path(std::string filename){
+    return map_path(filename, "landing");
+}
+
+
+// Radial histogram file that goes with an output file
+std::string radial_map_path(std::string filename){
+    return map_path(filename, "radial");
+}
+
+
+// Hit counts per cell of a grid as a binary table over z and the cell axes (the cell centres): the efficiency of every cell (%),
+// its absolute binomial error and the raw hits
+geo_table hit_map_table(const geo_results& results, const std::vector<std::vector<long long>>& cell_hits, std::vector<std::string> axis_names,
+                        std::vector<std::vector<double>> axes){
+    int n_cells = 1;
+    for (const std::vector<double>& axis : axes){
+        n_cells *= axis.size();
+    }
+    geo_table table;
+    std::vector<double> values(results.z.size() * n_cells), errors(values.size()), hits(values.size());
+    double factor = hit_factor(results.config);
+
+    for (int i = 0; i < results.z.size(); i++){
+        double n = results.outer[i].n;
+        for (int k = 0; k < n_cells; k++){
+            double cell = cell_hits[i][k];
+            values[i * n_cells + k] = factor * cell / n;
+            errors[i * n_cells + k] = factor * sqrt(cell * (1 - cell / n)) / n;
+            hits[i * n_cells + k] = cell;
+        }
+    }
+    table.params = config_params(results.config);
+    table.axis_names = axis_names;
+    table.axis_names.insert(table.axis_names.begin(), "z");
+    table.axes = axes;
+    table.axes.insert(table.axes.begin(), results.z);
+    table.array_names = {"value", "error", "hits"};
+    table.arrays = {values, errors, hits};
+    return table;
+}
+
+
+// Read the hit counts of n_cells cells per distance back from a table made by hit_map_table
+std::vector<std::vector<long long>> read_hit_map(const geo_results& results, int n_cells, std::string path, std::string filename){
+    geo_table_view table(path);
+    const double* hits = table.array("hits");
+    size_t table_cells = 1;
+    for (int k = 1; k < table.shape.size(); k++){
+        table_cells *= table.shape[k];
+    }
+
+    if (hits == nullptr || table.shape.size() < 2 || table.shape[0] != results.z.size() || table_cells != n_cells){
+        std::cerr << "ERROR: " << path << " does not match " << filename << std::endl;
+        exit(0);
+    }
+    std::vector<std::vector<long long>> cell_hits(results.z.size(), std::vector<long long>(n_cells));
+    for (int i = 0; i < results.z.size(); i++){
+        for (int k = 0; k < n_cells; k++){
+            cell_hits[i][k] = llround(hits[i * n_cells + k]);
+        }
+    }
+    return cell_hits;
+}
+
+
+// Write the per-pixel results of a pixelated detector next to the output file, over the pixel centres
+void write_pixel_map(const geo_results& results, std::string filename){
+    const geo_config& config = results.config;
+    std::vector<double> x_centres(config.pixels_x), y_centres(config.pixels_y);
+
+    for (int ix = 0; ix < config.pixels_x; ix++){
+        x_centres[ix] = -1 + (ix + 0.5) * 2.0 / config.pixels_x;
+    }
+    for (int iy = 0; iy < config.pixels_y; iy++){
+        y_centres[iy] = config.det_height * (-1 + (iy + 0.5) * 2.0 / config.pixels_y);
+    }
+    write_geo_table(hit_map_table(results, results.pixel_hits, {"y", "x"}, {y_centres, x_centres}), pixel_map_path(filename));
+}
+
+
+// Write the landing histogram of a run with '--landing' next to the output file, over the bin centres
+void write_landing_map(const geo_results& results, std::string filename){
+    landing_grid grid = histogram_grid(results.config);
+    std::vector<double> centres(grid.n_x);
+
+    for (int k = 0; k < grid.n_x; k++){
+        centres[k] = grid.x_min + (k + 0.5) * grid.bin;
+    }
+    write_geo_table(hit_map_table(results, results.landing_hits, {"y", "x"}, {centres, centres}), landing_map_path(filename));
+}
+
+
+// Write the radial histogram of a run with '--radial' next to the output file, over the bin centres in r^2, together with its
+// cumulative sum: the efficiency (%) of a hard detector edge at the outer edge r of every bin
+void write_radial_map(const geo_results& results, std::string filename){
+    const geo_config& config = results.config;
+    int n_bins = config.radial_bins;
+    double bin = config.radial_max * config.radial_max / n_bins;
+    std::vector<double> centres(n_bins), cumulative(results.z.size() * n_bins);
+
+    for (int k = 0; k < n_bins; k++){
+        centres[k] = (k + 0.5) * bin;
+    }
+    double factor = hit_factor(config);
+    for (int i = 0; i < results.z.size(); i++){
+        long long running = 0;
+        for (int k = 0; k < n_bins; k++){
+            running += results.radial_hits[i][k];
+            cumulative[i * n_bins + k] = factor * running / results.outer[i].n;
+        }
+    }
+    geo_table table = hit_map_table(results, results.radial_hits, {"r_sq"}, {centres});
+    table.array_names.push_back("cumulative");
+    table.arrays.push_back(cumulative);
+    write_geo_table(table, radial_map_path(filename));
+}
+
+
+// Write the output file; a '.gtab' filename gives the binary table format instead of text.
+// Both formats carry the run parameters and the raw counts, so they can be read back to refine a run.
+void write_geo_file(const geo_results& results, std::string filename) {
+    PROFILE_SCOPE(profile_io);
+    const std::vector<double>& z = results.z;
+    std::vector<double> e_ps = detector_point_source(results.config, z);
+    std::vector<double> efficiencies(z.size()), rel_ers(z.size());
+    std::map<std::string, std::string> params = config_params(results.config);
+
+    for (int i = 0; i < z.size(); i++) {
+        point_result(results, i, efficiencies[i], rel_ers[i]);
+    }
+    if (results.config.detector_type == "pixelated"){
+        write_pixel_map(results, filename);
+    }
+    if (results.config.landing_bins > 0){
+        write_landing_map(results, filename);
+    }
+    if (results.config.radial_bins > 0){
+        write_radial_map(results, filename);
+    }
+
+    if (ends_with(filename, ".gtab")){
+        geo_table table;
+        std::vector<double> errors(z.size()), hits(z.size()), hits_inner(z.size()), samples(z.size()), samples_inner(z.size());
+        std::vector<double> lower(z.size()), upper(z.size());
+        for (int i = 0; i < z.size(); i++) {
+            errors[i] = std::isfinite(rel_ers[i]) ? efficiencies[i] * rel_ers[i] / 100 : 0;  // Absolute uncertainty, same unit as the efficiency
+            point_interval(results, i, lower[i], upper[i]);
+            hits[i] = results.outer[i].N_hit;
+            hits_inner[i] = results.inner[i].N_hit;
+            samples[i] = results.outer[i].n;
+            samples_inner[i] = results.inner[i].n;
+        }
+        table.params = params;
+        table.axis_names = {"z"};
+        table.axes = {z};
+        table.array_names = {"value", "error", "point_source", "hits", "hits_inner", "samples", "samples_inner", "lower", "upper"};
+        table.arrays = {efficiencies, errors, e_ps, hits, hits_inner, samples, samples_inner, lower, upper};
+
+        // Running statistics of every circle as the arrays <name>_count, <name>_mean and <name>_m2
+        auto add_stats = [&](std::string name, running_stats point_counts::* member, const std::vector<point_counts>& circle){
+            std::vector<std::vector<double>> columns(3, std::vector<double>(z.size()));
+            for (int i = 0; i < z.size(); i++) {
+                const running_stats& stats = circle[i].*member;
+                columns[0][i] = stats.n;
+                columns[1][i] = stats.mean;
+                columns[2][i] = stats.m2;
+            }
+            table.array_names.insert(table.array_names.end(), {name + "_count", name + "_mean", name + "_m2"});
+            table.arrays.insert(table.arrays.end(), columns.begin(), columns.end());
+        };
+        if (results.config.derivatives){                                    // Derivatives, and the score statistics they come from
+            std::vector<std::string> names = {"dE_dz", "dE_dz_error", "dE_dsource", "dE_dsource_error"};
+            std::vector<std::vector<double>> columns(names.size(), std::vector<double>(z.size()));
+            for (int i = 0; i < z.size(); i++) {
+                point_derivatives(results, i, columns[0][i], columns[1][i], columns[2][i], columns[3][i]);
+            }
+            table.array_names.insert(table.array_names.end(), names.begin(), names.end());
+            table.arrays.insert(table.arrays.end(), columns.begin(), columns.end());
+            add_stats("score_z", &point_counts::score_z, results.outer);
+            add_stats("score_source", &point_counts::score_source, results.outer);
+            add_stats("score_z_inner", &point_counts::score_z, results.inner);
+            add_stats("score_source_inner", &point_counts::score_source, results.inner);
+        }
+        if (results.config.emission_weighted){                              // Effective sample size and weight statistics of weighted emission
+            std::vector<double> effective(z.size());
+            for (int i = 0; i < z.size(); i++) {
+                effective[i] = point_effective_samples(results, i);
+            }
+            table.array_names.push_back("effective_samples");
+            table.arrays.push_back(effective);
+            add_stats("weight", &point_counts::weight, results.outer);
+            add_stats("weight_inner", &point_counts::weight, results.inner);
+        }
+        write_geo_table(table, filename);
+        std::cout << "Wrote output file" << std::endl;
+        return;
+    }
+
+    std::ofstream myFile(filename);
+    myFile << "#";
+    for (auto const& param : params){
+        myFile << " " << param.first << "=" << param.second;
+    }
+    myFile << "\n";
+    myFile << result_columns(results.config);
+
+    for (int i = 0; i < z.size(); i++) {
+        myFile << result_row(results, i);
     }
     
     std::cout << "Wrote output file" << std::endl;
-    myFile.close();
+    myFile.close();
+}
+
+
+// Read an output file (text or binary) back into run parameters and raw counts
+geo_results read_geo_file(std::string filename){
+    geo_results results;
+    std::map<std::string, std::string> params;
+
+    if (ends_with(filename, ".gtab")){
+        geo_table_view table(filename);
+        const double* hits = table.array("hits");
+        const double* hits_inner = table.array("hits_inner");
+        const double* samples = table.array("samples");
+        const double* samples_inner = table.array("samples_inner");
+        if (hits == nullptr || hits_inner == nullptr || samples == nullptr || samples_inner == nullptr || table.shape.size() != 1){
+            std::cerr << "ERROR: " << filename << " does not contain raw counts" << std::endl;
+            exit(0);
+        }
+
+        params = table.params;
+        results.z.assign(table.axes[0], table.axes[0] + table.shape[0]);
+        for (size_t i = 0; i < table.shape[0]; i++){
+            point_counts outer, inner;
+            outer.N_hit = llround(hits[i]);
+            outer.n = llround(samples[i]);
+            inner.N_hit = llround(hits_inner[i]);
+            inner.n = llround(samples_inner[i]);
+            auto stats = [&](std::string name){                             // Arrays written by write_geo_file
+                running_stats stats;
+                stats.n = llround(table.array(name + "_count")[i]);
+                stats.mean = table.array(name + "_mean")[i];
+                stats.m2 = table.array(name + "_m2")[i];
+                return stats;
+            };
+            if (table.array("score_z_mean") != nullptr){
+                outer.score_z = stats("score_z");
+                outer.score_source = stats("score_source");
+                inner.score_z = stats("score_z_inner");
+                inner.score_source = stats("score_source_inner");
+            }
+            if (table.array("weight_mean") != nullptr){
+                outer.weight = stats("weight");
+                inner.weight = stats("weight_inner");
+            }
+            results.outer.push_back(outer);
+            results.inner.push_back(inner);
+        }
+    } else{
+        std::ifstream myFile(filename);
+        std::string line;
+        if (!myFile || !std::getline(myFile, line) || line.substr(0, 1) != "#"){
+            std::cerr << "ERROR: " << filename << " is not an output file with run parameters" << std::endl;
+            exit(0);
+        }
+        for (std::string item : split(line.substr(1), ' ')){
+            size_t eq = item.find('=');
+            if (eq != std::string::npos){
+                params[item.substr(0, eq)] = item.substr(eq + 1);
+            }
+        }
+        std::getline(myFile, line);                                         // Column names
+
+        while (std::getline(myFile, line)){
+            std::istringstream row(line);
+            double z;
+            std::string e_ps, efficiency, rel_er;                           // Derived values, may be 'inf' or 'nan' without hits
+            point_counts outer, inner;
+            if (row >> z >> e_ps >> efficiency >> rel_er >> outer.N_hit >> inner.N_hit >> outer.n >> inner.n){
+                results.z.push_back(z);
+                results.outer.push_back(outer);
+                results.inner.push_back(inner);
+            }
+        }
+    }
+
+    results.config = config_from_params(params);
+    if (results.config.detector_type == "pixelated"){
+        results.pixel_hits = read_hit_map(results, results.config.pixels_x * results.config.pixels_y, pixel_map_path(filename), filename);
+    }
+    if (results.config.landing_bins > 0){
+        results.landing_hits = read_hit_map(results, results.config.landing_bins * results.config.landing_bins, landing_map_path(filename), filename);
+    }
+    if (results.config.radial_bins > 0){
+        results.radial_hits = read_hit_map(results, results.config.radial_bins, radial_map_path(filename), filename);
+    }
+    if ((results.config.derivatives || results.config.emission_weighted) && !ends_with(filename, ".gtab")){
+        std::cerr << "ERROR: the text output of a run with derivatives or weighted emission has no raw sums; continue it from a .gtab output" << std::endl;
+        exit(0);
+    }
+    return results;
+}
+
+
+// Asynchronous output of finished points. A writer thread appends every point to '<filename>.partial' as soon as it is
+// pushed (so in completion order when running in parallel) and prints progress at most every console_interval seconds;
+// the compute threads never wait on the file or the terminal. The sorted output file is still written at the end.
+class point_writer {
+    public:
+        point_writer(const geo_results& results, std::string filename, double console_interval_in){     // Constructor: open the file and start the thread
+            partial_path = filename + ".partial";
+            console_interval = console_interval_in;
+            n_points = results.z.size();
+            partial_file.open(partial_path);
+            partial_file << "#";
+            for (auto const& param : config_params(results.config)){
+                partial_file << " " << param.first << "=" << param.second;
+            }
+            partial_file << "\n";
+            partial_file << result_columns(results.config);
+            partial_file.flush();
+            writer = std::thread(&point_writer::write_loop, this);
+        }
+
+        void push(const geo_results& results, int i){                                              // Queue a finished point; its values are copied
+            double efficiency, rel_er;
+            point_result(results, i, efficiency, rel_er);
+            std::string row = result_row(results, i);
+
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            queue.push_back({row, efficiency, rel_er});
+            ready.notify_one();
+        }
+
+        void finish(){                                                                             // Write what is left, stop the thread and drop the partial file
+            {
+                std::lock_guard<std::mutex> lock(queue_mutex);
+                done = true;
+                ready.notify_one();
+            }
+            writer.join();
+            partial_file.close();
+            remove(partial_path.c_str());
+        }
+
+    private:
+        struct finished_point {
+            std::string row;
+            double efficiency, rel_er;
+        };
+
+        std::string partial_path;
+        std::ofstream partial_file;
+        double console_interval;
+        int n_points, n_written = 0;
+        std::thread writer;
+        std::mutex queue_mutex;
+        std::condition_variable ready;
+        std::deque<finished_point> queue;
+        bool done = false;
+
+        void write_loop(){
+            auto last_print = std::chrono::steady_clock::now() - std::chrono::hours(1);
+
+            while (true){
+                std::deque<finished_point> batch;
+                {
+                    std::unique_lock<std::mutex> lock(queue_mutex);
+                    ready.wait(lock, [this](){ return done || !queue.empty(); });
+                    if (queue.empty() && done){
+                        return;
+                    }
+                    batch.swap(queue);
+                }
+
+                PROFILE_SCOPE(profile_io);
+                for (const finished_point& point : batch){
+                    partial_file << point.row;
+                }
+                partial_file.flush();                                                              // Let readers of the partial file see whole rows
+                n_written += batch.size();
+
+                auto now = std::chrono::steady_clock::now();
+                if (n_written == n_points || now - last_print >= std::chrono::duration<double>(console_interval)){
+                    std::cout << 100.0 * n_written / n_points << "\t" << batch.back().efficiency << "\t \t" << batch.back().rel_er << "\n";
+                    last_print = now;
+                }
+            }
+        }
+};
+
+
+// Write the checkpoint of an unfinished run: parameters, output filename and per point the counts so far and the sample
+// target (0 if not decided yet). Written to a temporary file and renamed, so a preemption never leaves a broken checkpoint.
+void write_checkpoint(const geo_results& results, const std::vector<long long>& n_targets, double target_rel_er, std::string filename){
+    PROFILE_SCOPE(profile_io);
+    std::string path = filename + ".ckpt";
+    std::string temp_path = path + ".tmp";
+    std::ofstream myFile(temp_path);
+
+    myFile << "#";
+    for (auto const& param : config_params(results.config)){
+        myFile << " " << param.first << "=" << param.second;
+    }
+    myFile << " filename=" << filename << " target_rel_er=" << exact_str(target_rel_er) << "\n";
+    myFile << "z/rd \t N_hit \t Samples \t N_hit inner \t Samples inner \t Target samples \t Score statistics outer (n, mean, M2 of z and source) \t Score statistics inner \t Weight statistics outer and inner (weighted emission) \t Pixel hits (pixelated) \t Landing histogram (--landing) \t Radial histogram (--radial) \n";
+
+    for (int i = 0; i < results.z.size(); i++){
+        const point_counts& outer = results.outer[i];
+        const point_counts& inner = results.inner[i];
+        myFile << exact_str(results.z[i]) << "\t" << outer.N_hit << "\t" << outer.n << "\t" << inner.N_hit << "\t" << inner.n << "\t" << n_targets[i];
+        for (const point_counts* counts : {&outer, &inner}){
+            myFile << "\t" << stats_str(counts->score_z) << "\t" << stats_str(counts->score_source);
+        }
+        if (results.config.emission_weighted){
+            myFile << "\t" << stats_str(outer.weight) << "\t" << stats_str(inner.weight);
+        }
+        if (results.config.detector_type == "pixelated"){
+            for (long long pixel : results.pixel_hits[i]){
+                myFile << "\t" << pixel;
+            }
+        }
+        if (results.config.landing_bins > 0){
+            for (long long bin : results.landing_hits[i]){
+                myFile << "\t" << bin;
+            }
+        }
+        if (results.config.radial_bins > 0){
+            for (long long bin : results.radial_hits[i]){
+                myFile << "\t" << bin;
+            }
+        }
+        myFile << "\n";
+    }
+    myFile.close();
+
+    if (!myFile || rename(temp_path.c_str(), path.c_str()) != 0){
+        std::cerr << "WARNING: could not write checkpoint " << path << std::endl;
+    }
+}
+
+
+// Read a checkpoint written by write_checkpoint
+void read_checkpoint(std::string path, geo_results& results, std::vector<long long>& n_targets, double& target_rel_er, std::string& filename){
+    std::ifstream myFile(path);
+    std::map<std::string, std::string> params;
+    std::string line;
+
+    if (!myFile || !std::getline(myFile, line) || line.substr(0, 1) != "#"){
+        std::cerr << "ERROR: " << path << " is not a checkpoint file" << std::endl;
+        exit(0);
+    }
+    for (std::string item : split(line.substr(1), ' ')){
+        size_t eq = item.find('=');
+        if (eq != std::string::npos){
+            params[item.substr(0, eq)] = item.substr(eq + 1);
+        }
+    }
+    filename = params["filename"];
+    target_rel_er = std::stod(params["target_rel_er"]);
+    results.config = config_from_params(params);
+    std::getline(myFile, line);                                             // Column names
+
+    while (std::getline(myFile, line)){
+        std::istringstream row(line);
+        double z;
+        long long n_target;
+        point_counts outer, inner;
+        bool valid = row >> z >> outer.N_hit >> outer.n >> inner.N_hit >> inner.n >> n_target && read_stats(row, outer.score_z)
+                     && read_stats(row, outer.score_source) && read_stats(row, inner.score_z) && read_stats(row, inner.score_source);
+        if (valid && results.config.emission_weighted){
+            valid = read_stats(row, outer.weight) && read_stats(row, inner.weight);
+        }
+        if (valid){
+            results.z.push_back(z);
+            results.outer.push_back(outer);
+            results.inner.push_back(inner);
+            n_targets.push_back(n_target);
+            if (results.config.detector_type == "pixelated"){
+                std::vector<long long> pixels(results.config.pixels_x * results.config.pixels_y);
+                for (long long& pixel : pixels){
+                    row >> pixel;
+                }
+                results.pixel_hits.push_back(pixels);
+            }
+            if (results.config.landing_bins > 0){
+                std::vector<long long> landing(results.config.landing_bins * results.config.landing_bins);
+                for (long long& bin : landing){
+                    row >> bin;
+                }
+                results.landing_hits.push_back(landing);
+            }
+            if (results.config.radial_bins > 0){
+                std::vector<long long> radial(results.config.radial_bins);
+                for (long long& bin : radial){
+                    row >> bin;
+                }
+                results.radial_hits.push_back(radial);
+            }
+        }
+    }
+}
+
+
+// Combine the output files of all shards of a run: merge <output> <shard file> [shard file ...].
+// The hit and sample counts are added, which gives exactly the result of a single run over all streams.
+void merge_shards(int argc, char **argv){
+    if (argc < 4){
+        std::cerr << "ERROR: usage 'merge <output> <shard file> [shard file ...]'" << std::endl;
+        exit(0);
+    }
+
+    geo_results merged;
+    std::vector<bool> seen;
+    for (int f = 3; f < argc; f++){
+        geo_results shard = read_geo_file(argv[f]);
+        geo_config config = shard.config;
+        int n_shards = config.n_shards, index = config.shard;
+
+        if (f == 3){
+            merged = shard;
+            merged.config.shard = 0;
+            merged.config.n_shards = 1;
+            seen.assign(n_shards, false);
+        } else{
+            config.shard = 0;
+            config.n_shards = 1;
+            bool same_config = config_params(config) == config_params(merged.config) && shard.z == merged.z && n_shards == seen.size();
+            if (!same_config){
+                std::cerr << "ERROR: " << argv[f] << " does not belong to the same run as " << argv[3] << std::endl;
+                exit(0);
+            }
+            for (int i = 0; i < merged.z.size(); i++){
+                merged.outer[i].add(shard.outer[i]);
+                merged.inner[i].add(shard.inner[i]);
+                if (config.detector_type == "pixelated"){
+                    for (int k = 0; k < merged.pixel_hits[i].size(); k++){
+                        merged.pixel_hits[i][k] += shard.pixel_hits[i][k];
+                    }
+                }
+                if (config.landing_bins > 0){
+                    for (int k = 0; k < merged.landing_hits[i].size(); k++){
+                        merged.landing_hits[i][k] += shard.landing_hits[i][k];
+                    }
+                }
+                if (config.radial_bins > 0){
+                    for (int k = 0; k < merged.radial_hits[i].size(); k++){
+                        merged.radial_hits[i][k] += shard.radial_hits[i][k];
+                    }
+                }
+            }
+        }
+
+        if (seen[index]){
+            std::cerr << "ERROR: shard " << index << "/" << n_shards << " is given twice" << std::endl;
+            exit(0);
+        }
+        seen[index] = true;
+    }
+
+    for (int i = 0; i < seen.size(); i++){
+        if (!seen[i]){
+            std::cerr << "ERROR: shard " << i << "/" << seen.size() << " is missing" << std::endl;
+            exit(0);
+        }
+    }
+    write_geo_file(merged, argv[2]);
+}
+
+
+// Hits as a function of a free parameter (the distance z or the source spread) on the grid p_min + e*(p_max - p_min)/n_bins,
+// all from one common set of n samples drawn with the usual RNG streams, so every grid value equals a normal run at that
+// parameter. The landing point source*xi + offset + (z + depth)*u of a sample is linear in either parameter, so the parameter values that give
+// a hit on a circle of radius R form one interval, the root interval of a quadratic; adding +1/-1 at its ends and summing
+// gives the hits at all grid values in a single pass.
+void crn_hit_curve(const geo_config& config, std::string fit_parameter, double fixed_value, double p_min, double p_max, int n_bins, long long n,
+                   std::vector<long long>& hits_outer, std::vector<long long>& hits_inner){
+    double delta = (p_max - p_min) / n_bins;
+    std::vector<long long> diff_outer(n_bins + 2, 0), diff_inner(n_bins + 2, 0);
+    bool annular = config.detector_type == "annular";
+
+    // Add the grid values inside the parameter interval where a x^2 + 2 b x + c <= 0
+    auto add_interval = [&](double a, double b, double c, std::vector<long long>& diff){
+        double discriminant = b * b - a * c;
+        if (a <= 0 || discriminant < 0){
+            return;
+        }
+        double lo = (-b - sqrt(discriminant)) / a, hi = (-b + sqrt(discriminant)) / a;
+        long long e_start = std::max((long long) ceil((lo - p_min) / delta), 0LL);
+        long long e_end = std::min((long long) floor((hi - p_min) / delta), (long long) n_bins);
+        if (e_start <= e_end){
+            diff[e_start]++;
+            diff[e_end + 1]--;
+        }
+    };
+
+    for (long long stream = 0; stream * STREAM_SIZE < n; stream++){
+        int n_stream = std::min(n - stream * STREAM_SIZE, (long long) STREAM_SIZE);
+        int stream_seed = config.seed + 2 * stream;
+        std::vector<double> x1(n_stream), x2(n_stream), y1(n_stream), y2(n_stream);
+        position unit_source(x1, y1);
+        position unit_emission(x2, y2);
+
+        if (config.source_type == "uniform"){                               // Source and emission at unit spread and unit distance
+            unit_source.generate_circular_distr(1, stream_seed);
+        } else{
+            unit_source.generate_gaussian_distr(1, stream_seed);
+        }
+        unit_emission.generate_isotropic(1, stream_seed + 1);
+        std::vector<double> depth = sample_depths(config, stream, n_stream);
+
+        for (int i = 0; i < n_stream; i++){
+            double free_x, free_y, fixed_x, fixed_y;                        // landing = p * free + fixed
+            double d = depth.empty() ? 0 : depth[i];                        // The emission travels z + d, still linear in z
+            if (fit_parameter == "z"){
+                free_x = unit_emission.x[i];
+                free_y = unit_emission.y[i];
+                fixed_x = fixed_value * unit_source.x[i] + d * unit_emission.x[i] + config.offset_x;
+                fixed_y = fixed_value * unit_source.y[i] + d * unit_emission.y[i] + config.offset_y;
+            } else{
+                free_x = unit_source.x[i];
+                free_y = unit_source.y[i];
+                fixed_x = (fixed_value + d) * unit_emission.x[i] + config.offset_x;
+                fixed_y = (fixed_value + d) * unit_emission.y[i] + config.offset_y;
+            }
+            double a = free_x * free_x + free_y * free_y;                  // |landing|^2 = a p^2 + 2 b p + c + R^2
+            double b = free_x * fixed_x + free_y * fixed_y;
+            double c = fixed_x * fixed_x + fixed_y * fixed_y;
+            add_interval(a, b, c - 1, diff_outer);
+            if (annular){
+                add_interval(a, b, c - 1 / (config.det_fraction * config.det_fraction), diff_inner);
+            }
+        }
+    }
+
+    hits_outer.assign(n_bins + 1, 0);
+    hits_inner.assign(n_bins + 1, 0);
+    long long running_outer = 0, running_inner = 0;
+    for (int e = 0; e <= n_bins; e++){
+        running_outer += diff_outer[e];
+        running_inner += diff_inner[e];
+        hits_outer[e] = running_outer;
+        hits_inner[e] = running_inner;
+    }
+}
+
+
+// First parameter value on the grid where the efficiency curve crosses the target, linearly interpolated (NaN if none)
+double crossing(const std::vector<double>& p, const std::vector<double>& efficiency, double target){
+    for (int e = 0; e + 1 < p.size(); e++){
+        double below = efficiency[e] - target, above = efficiency[e + 1] - target;
+        if (below == 0){
+            return p[e];
+        }
+        if ((below < 0) != (above < 0)){
+            return p[e] + (p[e + 1] - p[e]) * below / (below - above);
+        }
+    }
+    return NAN;
+}
+
+
+// Fit the distance or the source spread that explains a measured efficiency: inverse <source type> <detector type>
+void inverse_fit(int argc, char **argv){
+    geo_config config;
+    std::string fit_parameter;
+    double measured, measured_er, fixed_value, p_min, p_max;
+    const int n_bins = 1 << 16;
+
+    bool valid = argc >= 4 && argc % 2 == 0;
+    for (int i = 4; valid && i + 1 < argc; i += 2){
+        std::string flag = argv[i];
+        if (flag == "--offset"){
+            parse_offset(argv[i + 1], config);
+        } else if (flag == "--depth"){
+            config.depth = argv[i + 1];
+            load_depth_model(config.depth);                                 // Check the profile
+        } else{
+            valid = false;
+        }
+    }
+    if (!valid || (std::string(argv[2]) != "uniform" && std::string(argv[2]) != "gaussian")
+        || (std::string(argv[3]) != "circular" && std::string(argv[3]) != "annular")){
+        std::cerr << "ERROR: usage 'inverse <uniform|gaussian> <circular|annular> [--offset <dx,dy>] [--depth <profile>]'" << std::endl;
+        exit(0);
+    }
+    config.source_type = argv[2];
+    config.detector_type = argv[3];
+
+    // Input values
+    std::cout << "Fit parameter (z or source):" << std::endl;
+    std::cin >> fit_parameter;
+    if (fit_parameter != "z" && fit_parameter != "source"){
+        std::cerr << "ERROR: the fit parameter is 'z' or 'source'" << std::endl;
+        exit(0);
+    }
+    std::cout << "Measured efficiency (%):" << std::endl;
+    std::cin >> measured;
+    std::cout << "Measured uncertainty (%, absolute):" << std::endl;
+    std::cin >> measured_er;
+    std::cout << (fit_parameter == "z" ? "source/rd:" : "z/rd:") << std::endl;
+    std::cin >> fixed_value;
+    std::cout << "Search range min/rd:" << std::endl;
+    std::cin >> p_min;
+    std::cout << "Search range max/rd:" << std::endl;
+    std::cin >> p_max;
+    std::cout << "Power:" << std::endl;
+    std::cin >> config.power;
+    if (config.detector_type == "annular"){
+        std::cout << "Detector outer/inner:" << std::endl;
+        std::cin >> config.det_fraction;
+    }
+    if (p_min < 0 || p_max <= p_min){
+        std::cerr << "ERROR: the search range needs 0 <= min < max" << std::endl;
+        exit(0);
+    }
+    geo_config fixed = config;                                              // The fixed parameter with the search range
+    fixed.source = fit_parameter == "z" ? fixed_value : p_min;
+    std::string invalid = validate_config(fixed, fit_parameter == "z" ? std::vector<double>{p_min, p_max} : std::vector<double>{fixed_value});
+    if (invalid != ""){
+        std::cerr << "ERROR: " << invalid << std::endl;
+        exit(0);
+    }
+
+    long long n = llround(pow(10, config.power));
+    std::vector<long long> hits_outer, hits_inner;
+    crn_hit_curve(config, fit_parameter, fixed_value, p_min, p_max, n_bins, n, hits_outer, hits_inner);
+
+    std::vector<double> p = linspace(p_min, p_max, n_bins + 1), efficiency(n_bins + 1);
+    for (int e = 0; e <= n_bins; e++){
+        efficiency[e] = 50.0 * (hits_outer[e] - hits_inner[e]) / n;
+    }
+    double fit = crossing(p, efficiency, measured);
+    if (std::isnan(fit)){
+        std::cerr << "ERROR: the efficiency does not reach " << measured << "% for " << fit_parameter << " in [" << p_min << ", " << p_max << "]" << std::endl;
+        exit(0);
+    }
+
+    // Propagate the measurement and Monte Carlo uncertainties by inverting the curve at efficiency +- one total sigma
+    int e_fit = std::min((int) llround((fit - p_min) / (p_max - p_min) * n_bins), n_bins);
+    geo_results at_fit;
+    double efficiency_fit, rel_er_fit;
+    at_fit.config = config;
+    at_fit.z = {fit};
+    at_fit.outer.resize(1);
+    at_fit.inner.resize(1);
+    at_fit.outer[0].N_hit = hits_outer[e_fit];
+    at_fit.inner[0].N_hit = hits_inner[e_fit];
+    at_fit.outer[0].n = at_fit.inner[0].n = n;
+    point_result(at_fit, 0, efficiency_fit, rel_er_fit);
+    double total_er = sqrt(measured_er * measured_er + pow(efficiency_fit * rel_er_fit / 100, 2));
+    double p_high = crossing(p, efficiency, measured - total_er);
+    double p_low = crossing(p, efficiency, measured + total_er);
+    double fit_er = fabs(p_high - p_low) / 2;
+
+    std::cout << "Fitted " << fit_parameter << "/rd:\t" << fit << " +- " << fit_er << std::endl;
+    if (std::isnan(fit_er)){
+        std::cout << "(the uncertainty interval leaves the search range; widen it for an error estimate)" << std::endl;
+    }
+    std::cout << "Monte Carlo efficiency at the fit (%):\t" << efficiency_fit << " +- " << efficiency_fit * rel_er_fit / 100 << std::endl;
+    std::cout << "Samples used:\t" << n << std::endl;
+}
+
+
+// Count the hits of the outer and inner circle among samples [first, last) on n_threads threads, one RNG stream per task; the
+// counts do not depend on the number of threads
+void count_block(const geo_config& config, double z, long long first, long long last, int n_threads, point_counts& outer, point_counts& inner){
+    std::vector<long long> bounds = {first};
+    for (long long next = (first / STREAM_SIZE + 1) * STREAM_SIZE; next < last; next += STREAM_SIZE){
+        bounds.push_back(next);
+    }
+    bounds.push_back(last);
+    int n_tasks = bounds.size() - 1;
+    std::vector<point_counts> worker_outer(n_threads), worker_inner(n_threads);
+    std::vector<std::thread> workers;
+
+    for (int t = 0; t < std::min(n_threads, n_tasks); t++){
+        workers.emplace_back([&, t](){
+            for (int task = t; task < n_tasks; task += n_threads){
+                worker_outer[t].add(count_hits(config, z, 1, bounds[task], bounds[task + 1]));
+                if (config.detector_type == "annular"){
+                    worker_inner[t].add(count_hits(config, z, 1 / config.det_fraction, bounds[task], bounds[task + 1]));
+                }
+            }
+        });
+    }
+    for (int t = 0; t < workers.size(); t++){
+        workers[t].join();
+        outer.add(worker_outer[t]);
+        inner.add(worker_inner[t]);
+    }
+}
+
+
+// Decide whether the efficiency at one distance is above or below a threshold with as few samples as the data allow:
+// threshold <uniform|gaussian> <circular|annular> [--threads <n>] [--offset <dx,dy>] [--depth <profile>] [--interval <type>] [--sprt <w>].
+// Samples come in blocks that double from 10^4 up to 10^Power, and after every block one of two stopping rules is checked:
+//   - by default the confidence interval of the efficiency (see binomial_interval). Look k uses the level 1 - alpha / (k (k + 1)),
+//     so the chance that any look wrongly excludes the true efficiency stays below alpha. It stops when the interval lies
+//     entirely above or below the threshold.
+//   - with '--sprt w' Wald's sequential probability ratio test of threshold - w against threshold + w, with both error rates
+//     alpha. It stops when the log-likelihood ratio leaves [log(alpha / (1 - alpha)), log((1 - alpha) / alpha)]. This usually
+//     needs fewer samples, but an efficiency within w of the threshold may be decided either way.
+void threshold_query(int argc, char **argv){
+    geo_config config;
+    int n_threads = 1;
+    double z, threshold, confidence, sprt_width = 0;
+    const long long first_block = 10000;
+
+    bool valid = argc >= 4 && argc % 2 == 0;
+    for (int i = 4; valid && i + 1 < argc; i += 2){
+        std::string flag = argv[i];
+        if (flag == "--threads"){
+            n_threads = std::max(atoi(argv[i + 1]), 1);
+        } else if (flag == "--offset"){
+            parse_offset(argv[i + 1], config);
+        } else if (flag == "--depth"){
+            config.depth = argv[i + 1];
+            load_depth_model(config.depth);                                 // Check the profile
+        } else if (flag == "--interval" && (std::string(argv[i + 1]) == "wilson" || std::string(argv[i + 1]) == "clopper-pearson")){
+            config.interval = argv[i + 1];
+        } else if (flag == "--sprt"){
+            sprt_width = atof(argv[i + 1]);
+            valid = sprt_width > 0;
+        } else{
+            valid = false;
+        }
+    }
+    if (!valid || (std::string(argv[2]) != "uniform" && std::string(argv[2]) != "gaussian")
+        || (std::string(argv[3]) != "circular" && std::string(argv[3]) != "annular")){
+        std::cerr << "ERROR: usage 'threshold <uniform|gaussian> <circular|annular> [--threads <n>] [--offset <dx,dy>] [--depth <profile>] "
+                  << "[--interval <wilson|clopper-pearson>] [--sprt <width %>]'" << std::endl;
+        exit(0);
+    }
+    config.source_type = argv[2];
+    config.detector_type = argv[3];
+
+    // Input values
+    std::cout << "z/rd:" << std::endl;
+    std::cin >> z;
+    std::cout << "source/rd:" << std::endl;
+    std::cin >> config.source;
+    if (config.detector_type == "annular"){
+        std::cout << "Detector outer/inner:" << std::endl;
+        std::cin >> config.det_fraction;
+    }
+    std::cout << "Threshold efficiency (%):" << std::endl;
+    std::cin >> threshold;
+    std::cout << "Confidence (%):" << std::endl;
+    std::cin >> confidence;
+    std::cout << "Power (maximum samples):" << std::endl;
+    std::cin >> config.power;
+    std::string invalid = validate_config(config, {z});
+    if (invalid != ""){
+        std::cerr << "ERROR: " << invalid << std::endl;
+        exit(0);
+    }
+
+    double factor = hit_factor(config), alpha = 1 - confidence / 100;
+    double p_low = (threshold - sprt_width) / factor, p_high = (threshold + sprt_width) / factor;
+    if (!(z > 0) || !(alpha > 0 && alpha < 0.5) || !(p_low > 0 && p_high < 1)){
+        std::cerr << "ERROR: the query needs z/rd > 0, a confidence between 50 and 100% and threshold -+ width inside (0, " << factor << ")%" << std::endl;
+        exit(0);
+    }
+    long long n_max = llround(pow(10, config.power));
+    config.n_perpoint = n_max;
+
+    double log_lower = log(alpha / (1 - alpha)), log_upper = log((1 - alpha) / alpha);
+    point_counts outer, inner;
+    int decision = 0, look = 0;                                             // +1 above, -1 below the threshold
+    double lower = 0, upper = 1, log_ratio = 0;
+    while (decision == 0 && outer.n < n_max){
+        look++;
+        count_block(config, z, outer.n, std::min(std::max(2 * outer.n, first_block), n_max), n_threads, outer, inner);
+        long long k = outer.N_hit - inner.N_hit, n = outer.n;
+
+        if (sprt_width > 0){
+            log_ratio = k * log(p_high / p_low) + (n - k) * log((1 - p_high) / (1 - p_low));
+            decision = log_ratio >= log_upper ? 1 : (log_ratio <= log_lower ? -1 : 0);
+        } else{
+            binomial_interval(k, n, config.interval == "clopper-pearson", lower, upper, alpha / (look * (look + 1.0)));
+            decision = lower * factor > threshold ? 1 : (upper * factor < threshold ? -1 : 0);
+        }
+    }
+
+    geo_results results;
+    double efficiency, rel_er;
+    results.config = config;
+    results.z = {z};
+    results.outer = {outer};
+    results.inner = {inner};
+    point_result(results, 0, efficiency, rel_er);
+    double interval_alpha = sprt_width > 0 ? alpha : alpha / (look * (look + 1.0));  // The level the last look was tested at
+    binomial_interval(outer.N_hit - inner.N_hit, outer.n, config.interval == "clopper-pearson", lower, upper, interval_alpha);
+
+    std::cout << "Decision:\t" << (decision > 0 ? "above " : (decision < 0 ? "below " : "undecided at ")) << threshold << "%";
+    if (decision == 0){
+        std::cout << " (no decision within 10^" << config.power << " samples)" << std::endl;
+    } else{
+        std::cout << std::endl << "Confidence (%):\t" << confidence << std::endl;
+    }
+    std::cout << "Efficiency (%):\t" << efficiency << " +- " << efficiency * rel_er / 100 << std::endl;
+    std::cout << 100 * (1 - interval_alpha) << "% interval (%):\t" << lower * factor << " - " << upper * factor << std::endl;
+    if (sprt_width > 0){
+        std::cout << "Log-likelihood ratio:\t" << log_ratio << " (bounds " << log_lower << ", " << log_upper << ")" << std::endl;
+    }
+    std::cout << "Samples used:\t" << outer.n << " in " << look << " blocks" << std::endl;
+}
+
+
+// One detector of a multi-detector setup: a ring (inner radius 0 for a full circle) at distance z, centred at (offset_x, offset_y)
+struct detector_spec {
+    double z, outer, inner, offset_x, offset_y;
+};
+
+
+// Read a detector list: one detector per line as '<z> <outer radius> <inner radius> <offset x> <offset y>', all lengths in the
+// same unit as the source spread; empty lines and lines starting with '#' are skipped
+std::vector<detector_spec> read_detector_list(std::string filename){
+    std::ifstream myFile(filename);
+    std::vector<detector_spec> detectors;
+    std::string line;
+
+    if (!myFile){
+        std::cerr << "ERROR: could not open detector list " << filename << std::endl;
+        exit(0);
+    }
+    while (std::getline(myFile, line)){
+        if (line.find_first_not_of(" \t\r") == std::string::npos || line[line.find_first_not_of(" \t\r")] == '#'){
+            continue;
+        }
+        std::istringstream row(line);
+        detector_spec detector;
+        if (!(row >> detector.z >> detector.outer >> detector.inner >> detector.offset_x >> detector.offset_y) || detector.z <= 0
+            || detector.outer <= 0 || detector.inner < 0 || detector.inner >= detector.outer){
+            std::cerr << "ERROR: bad detector line '" << line << "', expected '<z> <outer> <inner> <offset x> <offset y>' with z > 0 and 0 <= inner < outer" << std::endl;
+            exit(0);
+        }
+        detectors.push_back(detector);
+    }
+    if (detectors.empty()){
+        std::cerr << "ERROR: " << filename << " lists no detectors" << std::endl;
+        exit(0);
+    }
+    return detectors;
+}
+
+
+// Count the hits of every detector among samples [first, last) of the streams with stream % n_workers == worker, all from the
+// same source and emission samples. The direction of a sample does not depend on the detector, so it is drawn once at unit
+// distance and scaled by the z of each detector. joint_hits[j * N + k] counts the samples that hit both detectors j and k
+// (the diagonal holds the hits per detector), which gives the covariance of the efficiencies.
+void count_hits_multi(const geo_config& config, const std::vector<detector_spec>& detectors, long long n, int worker, int n_workers,
+                      std::vector<long long>& joint_hits){
+    int n_detectors = detectors.size();
+    std::vector<int> hit_list(n_detectors);
+
+    for (long long stream = worker; stream * STREAM_SIZE < n; stream += n_workers){
+        int n_stream = std::min(n - stream * STREAM_SIZE, (long long) STREAM_SIZE);
+        int stream_seed = config.seed + 2 * stream;
+        std::vector<double> x1(n_stream), x2(n_stream), y1(n_stream), y2(n_stream);
+        position generate_source(x1, y1);
+        position generate_emission(x2, y2);
+
+        generate_source_distr(config, generate_source, stream_seed);        // Generate source position
+        generate_emission.generate_isotropic(1, stream_seed + 1);           // Direction as the displacement at unit distance
+
+        for (int i = 0; i < n_stream; i++){
+            int n_hit = 0;
+            for (int k = 0; k < n_detectors; k++){
+                const detector_spec& detector = detectors[k];
+                double x = generate_source.x[i] + detector.z * generate_emission.x[i] - detector.offset_x;
+                double y = generate_source.y[i] + detector.z * generate_emission.y[i] - detector.offset_y;
+                double r_sq = x * x + y * y;
+                if (r_sq <= detector.outer * detector.outer && r_sq > detector.inner * detector.inner){
+                    hit_list[n_hit++] = k;
+                }
+            }
+            for (int a = 0; a < n_hit; a++){                                // Usually zero or one detector, so this stays cheap
+                for (int b = 0; b < n_hit; b++){
+                    joint_hits[hit_list[a] * n_detectors + hit_list[b]]++;
+                }
+            }
+        }
+    }
+}
+
+
+// Evaluate several detectors on one set of samples: multi <uniform|gaussian> <detector list> [--threads <n>].
+// Writes the efficiency of every detector and the covariance and correlation matrices of the efficiencies.
+void multi_detector(int argc, char **argv){
+    geo_config config;
+    int n_threads = 1;
+    std::string filename;
+
+    if (argc < 4 || (std::string(argv[2]) != "uniform" && std::string(argv[2]) != "gaussian")){
+        std::cerr << "ERROR: usage 'multi <uniform|gaussian> <detector list> [--threads <n>]'" << std::endl;
+        exit(0);
+    }
+    for (int i = 4; i < argc; i++){
+        std::string flag = argv[i];
+        if (flag == "--threads" && i + 1 < argc){
+            n_threads = std::max(atoi(argv[++i]), 1);
+        } else{
+            std::cerr << "ERROR: unknown option " << flag << "; the option is '--threads <n>'" << std::endl;
+            exit(0);
+        }
+    }
+    config.source_type = argv[2];
+    config.detector_type = "multi";
+    std::vector<detector_spec> detectors = read_detector_list(argv[3]);
+    int n_detectors = detectors.size();
+
+    // Input values
+    std::cout << "source spread:" << std::endl;
+    std::cin >> config.source;
+    std::cout << "Power:" << std::endl;
+    std::cin >> config.power;
+    std::cout << "Filename:" << std::endl;
+    std::cin >> filename;
+    for (int k = 0; k < n_detectors; k++){                                  // Every detector as a run in units of its outer radius
+        const detector_spec& detector = detectors[k];
+        geo_config single = config;
+        single.detector_type = detector.inner > 0 ? "annular" : "circular";
+        single.det_fraction = detector.inner > 0 ? detector.outer / detector.inner : 1;
+        single.source = config.source / detector.outer;
+        single.offset_x = detector.offset_x / detector.outer;
+        single.offset_y = detector.offset_y / detector.outer;
+        std::string invalid = validate_config(single, {detector.z / detector.outer});
+        if (invalid != ""){
+            std::cerr << "ERROR: detector " << k << ": " << invalid << std::endl;
+            exit(0);
+        }
+    }
+    long long n = llround(pow(10, config.power));
+    config.n_perpoint = n;
+
+    // Every worker takes every n_threads-th stream; the sums do not depend on the number of threads
+    std::vector<std::vector<long long>> worker_hits(n_threads, std::vector<long long>(n_detectors * n_detectors, 0));
+    std::vector<std::thread> workers;
+    for (int t = 0; t < n_threads; t++){
+        workers.emplace_back(count_hits_multi, std::cref(config), std::cref(detectors), n, t, n_threads, std::ref(worker_hits[t]));
+    }
+    std::vector<long long> joint_hits(n_detectors * n_detectors, 0);
+    for (int t = 0; t < n_threads; t++){
+        workers[t].join();
+        for (int k = 0; k < joint_hits.size(); k++){
+            joint_hits[k] += worker_hits[t][k];
+        }
+    }
+
+    // Efficiency of detector k is the mean of X_k = 50 * hit_k over the samples, Cov(E_j, E_k) = Cov(X_j, X_k) / n
+    std::vector<double> efficiencies(n_detectors), covariance(n_detectors * n_detectors);
+    for (int k = 0; k < n_detectors; k++){
+        efficiencies[k] = 50.0 * joint_hits[k * n_detectors + k] / n;
+    }
+    for (int j = 0; j < n_detectors; j++){
+        for (int k = 0; k < n_detectors; k++){
+            covariance[j * n_detectors + k] = (2500.0 * joint_hits[j * n_detectors + k] / n - efficiencies[j] * efficiencies[k]) / n;
+        }
+    }
+
+    std::ofstream myFile(filename);
+    myFile << "#";
+    for (auto const& param : config_params(config)){
+        myFile << " " << param.first << "=" << param.second;
+    }
+    myFile << " detector_list=" << argv[3] << "\n";
+    myFile << "detector \t z \t outer \t inner \t offset x \t offset y \t point source \t Model \t Uncertainty \t N_hit \t Samples \n";
+    for (int k = 0; k < n_detectors; k++){
+        const detector_spec& detector = detectors[k];
+        double offset = hypot(detector.offset_x, detector.offset_y);
+        double e_ps = point_source({detector.z / detector.outer}, offset / detector.outer)[0];
+        if (detector.inner > 0){
+            e_ps -= point_source({detector.z / detector.inner}, offset / detector.inner)[0];
+        }
+        myFile << k << "\t" << exact_str(detector.z) << "\t" << exact_str(detector.outer) << "\t" << exact_str(detector.inner) << "\t"
+               << exact_str(detector.offset_x) << "\t" << exact_str(detector.offset_y) << "\t" << e_ps << "\t" << efficiencies[k] << "\t"
+               << sqrt(covariance[k * n_detectors + k]) << "\t" << joint_hits[k * n_detectors + k] << "\t" << n << "\n";
+    }
+    myFile << "# covariance (%^2)\n";
+    for (int j = 0; j < n_detectors; j++){
+        for (int k = 0; k < n_detectors; k++){
+            myFile << (k > 0 ? "\t" : "") << covariance[j * n_detectors + k];
+        }
+        myFile << "\n";
+    }
+    myFile << "# correlation\n";
+    for (int j = 0; j < n_detectors; j++){
+        for (int k = 0; k < n_detectors; k++){
+            double norm = sqrt(covariance[j * n_detectors + j] * covariance[k * n_detectors + k]);
+            myFile << (k > 0 ? "\t" : "") << (norm > 0 ? covariance[j * n_detectors + k] / norm : 0);
+        }
+        myFile << "\n";
+    }
+    myFile.close();
+
+    for (int k = 0; k < n_detectors; k++){
+        std::cout << "Detector " << k << ":\t" << efficiencies[k] << " +- " << sqrt(covariance[k * n_detectors + k]) << std::endl;
+    }
+    std::cout << "Wrote output file" << std::endl;
+}
+
+
+// In-place radix-2 FFT of size (a power of 2) complex values; the inverse transform is not normalised
+void fft(std::complex<double>* data, size_t size, bool inverse){
+    for (size_t i = 1, j = 0; i < size; i++){                               // Bit-reversal permutation
+        size_t bit = size >> 1;
+        for (; j & bit; bit >>= 1){
+            j ^= bit;
+        }
+        j ^= bit;
+        if (i < j){
+            std::swap(data[i], data[j]);
+        }
+    }
+    for (size_t length = 2; length <= size; length <<= 1){
+        std::vector<std::complex<double>> twiddle(length / 2);
+        for (size_t k = 0; k < length / 2; k++){
+            twiddle[k] = std::polar(1.0, (inverse ? 2 : -2) * pi * k / length);
+        }
+        for (size_t start = 0; start < size; start += length){
+            for (size_t k = 0; k < length / 2; k++){
+                std::complex<double> even = data[start + k], odd = twiddle[k] * data[start + k + length / 2];
+                data[start + k] = even + odd;
+                data[start + k + length / 2] = even - odd;
+            }
+        }
+    }
+}
+
+
+// 2D FFT of a size x size grid (row by row): the rows, a transpose, the rows again and a transpose back
+void fft_2d(std::vector<std::complex<double>>& grid, size_t size, bool inverse){
+    for (int pass = 0; pass < 2; pass++){
+        for (size_t row = 0; row < size; row++){
+            fft(&grid[row * size], size, inverse);
+        }
+        for (size_t a = 0; a < size; a++){
+            for (size_t b = a + 1; b < size; b++){
+                std::swap(grid[a * size + b], grid[b * size + a]);
+            }
+        }
+    }
+}
+
+
+// Share of the square bin of size h centred at (x, y) that lies inside the circle of radius rho around the origin; bins
+// that the circle crosses are sampled on a 32 x 32 subgrid
+double disk_coverage(double x, double y, double h, double rho){
+    double near_x = std::max(fabs(x) - h / 2, 0.0), near_y = std::max(fabs(y) - h / 2, 0.0);
+    double far_x = fabs(x) + h / 2, far_y = fabs(y) + h / 2;
+    if (far_x * far_x + far_y * far_y <= rho * rho){
+        return 1;
+    }
+    if (near_x * near_x + near_y * near_y >= rho * rho){
+        return 0;
+    }
+    const int n_sub = 32;
+    int inside = 0;
+    for (int a = 0; a < n_sub; a++){
+        for (int b = 0; b < n_sub; b++){
+            double u = x + h * ((a + 0.5) / n_sub - 0.5), v = y + h * ((b + 0.5) / n_sub - 0.5);
+            inside += u * u + v * v <= rho * rho;
+        }
+    }
+    return 1.0 * inside / (n_sub * n_sub);
+}
+
+
+// Landing histogram of the samples of streams worker, worker + n_workers, ... with the source centred on the axis
+void bin_landings_worker(const geo_config& config, double z, const landing_grid& grid, long long n, int worker, int n_workers,
+                         std::vector<long long>& histogram){
+    for (long long stream = worker; stream * STREAM_SIZE < n; stream += n_workers){
+        int n_stream = std::min(n - stream * STREAM_SIZE, (long long) STREAM_SIZE);
+        std::vector<double> x1(n_stream), x2(n_stream), y1(n_stream), y2(n_stream);
+        position generate_source(x1, y1);
+        position generate_emission(x2, y2);
+        std::vector<double> depth;
+        sample_stream(config, z, stream, generate_source, generate_emission, depth);
+        bin_landings(grid, generate_source, aperture_survivors(config, z, generate_source, generate_emission, depth, 0, n_stream), histogram);
+    }
+}
+
+
+// Efficiency map over a grid of source offsets: offsetmap <uniform|gaussian> <circular|annular> [--threads <n>] [--depth <profile>]
+// [--emission <model>]. Moving the source only translates every landing point, so the hits at offset o are the landing points
+// L (drawn once, source on the axis) with L + o on the detector: the correlation of the landing histogram H with the detector
+// indicator D, E(o) = sum_u H(u) D(u + o), which an FFT gives for all offsets at once. The landing bins are a fraction of the
+// offset step (at most 1/128 rd where the FFT size allows it), and D is the share of each bin inside the detector, so binning
+// only smooths the detector edge on the scale of a bin. Written as a .gtab table over (offset_y, offset_x).
+void offset_map(int argc, char **argv){
+    geo_config config;
+    int n_threads = 1, n_offsets;
+    double z, offset_range;
+    std::string filename;
+    const int max_fft = 2048;                                               // Largest FFT per axis, 64 MB per complex grid
+
+    if (argc < 4 || (std::string(argv[2]) != "uniform" && std::string(argv[2]) != "gaussian")
+        || (std::string(argv[3]) != "circular" && std::string(argv[3]) != "annular")){
+        std::cerr << "ERROR: usage 'offsetmap <uniform|gaussian> <circular|annular> [--threads <n>] [--depth <profile>] [--emission <model>]'" << std::endl;
+        exit(0);
+    }
+    for (int i = 4; i < argc; i++){
+        std::string flag = argv[i];
+        if (flag == "--threads" && i + 1 < argc){
+            n_threads = std::max(atoi(argv[++i]), 1);
+        } else if (flag == "--depth" && i + 1 < argc){
+            config.depth = argv[++i];
+            load_depth_model(config.depth);                                 // Check the profile
+        } else if (flag == "--emission" && i + 1 < argc){
+            config.emission = argv[++i];
+            load_emission_model(config.emission);                           // Check the model and build its tables once
+        } else{
+            std::cerr << "ERROR: unknown option " << flag << "; options are '--threads <n>', '--depth <profile>' and '--emission <model>'" << std::endl;
+            exit(0);
+        }
+    }
+    config.source_type = argv[2];
+    config.detector_type = argv[3];
+
+    // Input values
+    std::cout << "z/rd:" << std::endl;
+    std::cin >> z;
+    std::cout << "source/rd:" << std::endl;
+    std::cin >> config.source;
+    std::cout << "Power:" << std::endl;
+    std::cin >> config.power;
+    if (config.detector_type == "annular"){
+        std::cout << "Detector outer/inner:" << std::endl;
+        std::cin >> config.det_fraction;
+    }
+    std::cout << "Offset range/rd (offsets from -range to range in x and y):" << std::endl;
+    std::cin >> offset_range;
+    std::cout << "Offset points per axis:" << std::endl;
+    std::cin >> n_offsets;
+    std::cout << "Filename:" << std::endl;
+    std::cin >> filename;
+    if (!(z > 0) || !(offset_range > 0) || n_offsets < 2){
+        std::cerr << "ERROR: the offset map needs z/rd > 0, an offset range > 0 and at least 2 offset points per axis" << std::endl;
+        exit(0);
+    }
+    std::string invalid = validate_config(config, {z});
+    if (invalid != ""){
+        std::cerr << "ERROR: " << invalid << std::endl;
+        exit(0);
+    }
+    if (!ends_with(filename, ".gtab")){
+        std::cerr << "ERROR: the offset map is written as a binary table, use a .gtab filename" << std::endl;
+        exit(0);
+    }
+    long long n = llround(pow(10, config.power));
+    config.n_perpoint = n;
+
+    // Landing bins of size h = step / m, the largest m up to step * 128 for which the grid fits the FFT size. The bins are
+    // centred on offset_range + h * Z, so u + o always falls on a bin centre of D.
+    double step = 2 * offset_range / (n_offsets - 1), h = step;
+    int m = (int) ceil(step * 128), n_pad = 0, n_bins = 0;
+    for (; m >= 1; m--){
+        h = step / m;
+        n_pad = (int) ceil(1 / h) + 1;                                      // Bins beyond the offset range that can still hit
+        n_bins = (n_offsets - 1) * m + 2 * n_pad + 1;
+        if (n_bins <= max_fft){
+            break;
+        }
+    }
+    if (m < 1){
+        std::cerr << "ERROR: the offset grid needs more than " << max_fft << " landing bins per axis; use fewer offset points or a smaller range" << std::endl;
+        exit(0);
+    }
+    if (h > 1.0 / 32){
+        std::cerr << "WARNING: landing bins of " << h << " rd; the map is smoothed on that scale" << std::endl;
+    }
+    landing_grid grid;
+    grid.bin = h;
+    grid.n_x = grid.n_y = n_bins;
+    grid.x_min = grid.y_min = -offset_range - (n_pad + 0.5) * h;
+
+    // Every worker takes every n_threads-th stream; the histogram does not depend on the number of threads
+    std::vector<std::vector<long long>> worker_histograms(n_threads, std::vector<long long>((size_t) n_bins * n_bins, 0));
+    std::vector<std::thread> workers;
+    for (int t = 0; t < n_threads; t++){
+        workers.emplace_back(bin_landings_worker, std::cref(config), z, std::cref(grid), n, t, n_threads, std::ref(worker_histograms[t]));
+    }
+    size_t n_fft = 1;
+    while (n_fft < n_bins){
+        n_fft <<= 1;
+    }
+    std::vector<std::complex<double>> landings(n_fft * n_fft, 0), detector(n_fft * n_fft, 0);
+    for (int t = 0; t < n_threads; t++){
+        workers[t].join();
+        for (int iy = 0; iy < n_bins; iy++){
+            for (int ix = 0; ix < n_bins; ix++){
+                landings[iy * n_fft + ix] += (double) worker_histograms[t][(size_t) iy * n_bins + ix];
+            }
+        }
+        std::vector<long long>().swap(worker_histograms[t]);
+    }
+
+    // D on bins centred at (j - n_pad) h, j = 0 ... 2 n_pad; the annulus is the outer minus the inner disk
+    for (int jy = 0; jy <= 2 * n_pad; jy++){
+        for (int jx = 0; jx <= 2 * n_pad; jx++){
+            double x = (jx - n_pad) * h, y = (jy - n_pad) * h;
+            double inside = disk_coverage(x, y, h, 1);
+            if (config.detector_type == "annular"){
+                inside -= disk_coverage(x, y, h, 1 / config.det_fraction);
+            }
+            detector[jy * n_fft + jx] = inside;
+        }
+    }
+
+    // E at offset index (i_x, i_y) is the circular correlation at t = (i - (n_offsets - 1)) m, free of wrap-around as n_fft >= n_bins
+    fft_2d(landings, n_fft, false);
+    fft_2d(detector, n_fft, false);
+    for (size_t k = 0; k < landings.size(); k++){
+        landings[k] = std::conj(landings[k]) * detector[k];
+    }
+    fft_2d(landings, n_fft, true);
+
+    std::vector<double> offsets = linspace(-offset_range, offset_range, n_offsets);
+    std::vector<double> values(n_offsets * n_offsets), errors(values.size()), hits(values.size()), e_ps(values.size());
+    double factor = hit_factor(config);
+    for (int i_y = 0; i_y < n_offsets; i_y++){
+        for (int i_x = 0; i_x < n_offsets; i_x++){
+            size_t t_x = n_fft - (n_offsets - 1 - i_x) * m, t_y = n_fft - (n_offsets - 1 - i_y) * m;  // t mod n_fft
+            double p = std::min(std::max(landings[(t_y % n_fft) * n_fft + t_x % n_fft].real() / (1.0 * n_fft * n_fft) / n, 0.0), 1.0);
+            int k = i_y * n_offsets + i_x;
+            values[k] = factor * p;
+            errors[k] = factor * sqrt(p * (1 - p) / n);
+            hits[k] = p * n;
+        }
+    }
+
+    // Point sources row by row over the threads; with a depth profile and emission every one is a double quadrature
+    std::vector<std::thread> ps_workers;
+    for (int t = 0; t < n_threads; t++){
+        ps_workers.emplace_back([&, t](){
+            geo_config at_offset = config;
+            for (int i_y = t; i_y < n_offsets; i_y += n_threads){
+                for (int i_x = 0; i_x < n_offsets; i_x++){
+                    at_offset.offset_x = offsets[i_x];
+                    at_offset.offset_y = offsets[i_y];
+                    e_ps[i_y * n_offsets + i_x] = detector_point_source(at_offset, {z})[0];
+                }
+            }
+        });
+    }
+    for (std::thread& worker : ps_workers){
+        worker.join();
+    }
+
+    geo_table table;
+    table.params = config_params(config);
+    table.params["z"] = exact_str(z);
+    table.params["landing_bin"] = exact_str(h);
+    table.axis_names = {"offset_y", "offset_x"};
+    table.axes = {offsets, offsets};
+    table.array_names = {"value", "error", "hits", "point_source"};
+    table.arrays = {values, errors, hits, e_ps};
+    write_geo_table(table, filename);
+
+    int centre = (n_offsets / 2) * n_offsets + n_offsets / 2;
+    std::cout << "Landing bins:\t" << h << " rd, " << n_bins << " per axis" << std::endl;
+    std::cout << "Efficiency at offset (" << offsets[n_offsets / 2] << ", " << offsets[n_offsets / 2] << "):\t" << values[centre] << " +- " << errors[centre] << std::endl;
+    std::cout << "Wrote output file" << std::endl;
+}
+
+
+// Fixed set of worker threads that run queued tasks
+class thread_pool {
+    public:
+        thread_pool(int n_threads){                                                                // Constructor: start the workers
+            for (int t = 0; t < n_threads; t++){
+                workers.emplace_back([this](){ work(); });
+            }
+        }
+
+        ~thread_pool(){                                                                            // Destructor: finish the queue and stop the workers
+            {
+                std::lock_guard<std::mutex> lock(queue_mutex);
+                stopping = true;
+            }
+            ready.notify_all();
+            for (std::thread& worker : workers){
+                worker.join();
+            }
+        }
+
+        void submit(std::function<void()> task){
+            {
+                std::lock_guard<std::mutex> lock(queue_mutex);
+                tasks.push_back(task);
+            }
+            ready.notify_one();
+        }
+
+    private:
+        std::vector<std::thread> workers;
+        std::deque<std::function<void()>> tasks;
+        std::mutex queue_mutex;
+        std::condition_variable ready;
+        bool stopping = false;
+
+        void work(){
+            while (true){
+                std::function<void()> task;
+                {
+                    std::unique_lock<std::mutex> lock(queue_mutex);
+                    ready.wait(lock, [this](){ return stopping || !tasks.empty(); });
+                    if (tasks.empty()){
+                        return;
+                    }
+                    task = tasks.front();
+                    tasks.pop_front();
+                }
+                task();
+            }
+        }
+};
+
+
+// Counts of all points calculated by the server, kept in memory for its whole lifetime (and on disk with a cache directory)
+class counts_store {
+    public:
+        std::string cache_dir;
+
+        point_counts get(const geo_config& config, double z, double radius, long long n){
+            std::string key = point_key(config, z, radius);
+            point_counts counts;
+            {
+                std::lock_guard<std::mutex> lock(store_mutex);
+                auto found = store.find(key);
+                if (found != store.end()){
+                    counts = found->second;
+                }
+            }
+            if (counts.n >= n){                                             // Warm: answered without sampling
+                return counts;
+            }
+
+            counts = geom_counts_point(config, z, radius, n, cache_dir, counts);
+            std::lock_guard<std::mutex> lock(store_mutex);
+            if (counts.n > store[key].n){
+                store[key] = counts;
+            }
+            return counts;
+        }
+
+    private:
+        std::map<std::string, point_counts> store;
+        std::mutex store_mutex;
+};
+
+
+// Send a whole string over a socket
+bool send_all(int fd, std::string text){
+    size_t sent = 0;
+
+    while (sent < text.size()){
+        ssize_t result = send(fd, text.data() + sent, text.size() - sent, MSG_NOSIGNAL);
+        if (result <= 0){
+            return false;
+        }
+        sent += result;
+    }
+    return true;
+}
+
+
+// Answer the queries of one client. Each request line is
+//   <source type> <detector type> <source/rd> <detector outer/inner> <Power> <z/rd> [z/rd ...] [offset <dx/rd> <dy/rd>]
+// and is answered with one line per distance, in the order they finish:
+//   <z/rd> \t <efficiency (%)> \t <relative uncertainty (%)> \t <N_hit> \t <N_hit inner> \t <samples>
+// followed by a line 'end'. A malformed request, or one that validate_config refuses, gives a single line 'error <message>'.
+void serve_client(int fd, thread_pool& pool, counts_store& store){
+    std::string buffer;
+    char chunk[4096];
+    std::mutex send_mutex;
+
+    while (true){
+        size_t newline;
+        while ((newline = buffer.find('\n')) == std::string::npos){
+            ssize_t received = recv(fd, chunk, sizeof(chunk), 0);
+            if (received <= 0){
+                close(fd);
+                return;
+            }
+            buffer.append(chunk, received);
+        }
+        std::string line = buffer.substr(0, newline);
+        buffer.erase(0, newline + 1);
+
+        std::istringstream request(line);
+        geo_config config;
+        std::vector<double> z;
+        double value;
+        request >> config.source_type >> config.detector_type >> config.source >> config.det_fraction >> config.power;
+        while (request >> value){
+            z.push_back(value);
+        }
+        bool valid_tail = request.eof();
+        if (!valid_tail){                                                   // Only an offset may follow the distances
+            std::string word;
+            request.clear();
+            valid_tail = request >> word && word == "offset" && request >> config.offset_x >> config.offset_y && !(request >> word);
+        }
+
+        bool valid_source = config.source_type == "uniform" || config.source_type == "gaussian";
+        bool valid_detector = config.detector_type == "circular" || config.detector_type == "annular";
+        if (!valid_tail || !valid_source || !valid_detector || config.power < 0 || config.power > 12 || z.empty()){
+            send_all(fd, "error expected '<uniform|gaussian> <circular|annular> <source/rd> <outer/inner> <Power> <z/rd> ... [offset <dx> <dy>]'\n");
+            continue;
+        }
+        std::string invalid = validate_config(config, z);
+        if (invalid != ""){                                                 // The same checks as a run from the command line
+            send_all(fd, "error " + invalid + "\n");
+            continue;
+        }
+
+        // Spread the distances over the pool and stream every answer back as soon as it is known
+        long long n = llround(pow(10, config.power));
+        int remaining = z.size();
+        std::mutex done_mutex;
+        std::condition_variable all_done;
+        for (double z_point : z){
+            pool.submit([&, z_point](){
+                geo_results results;
+                double efficiency, rel_er;
+                results.config = config;
+                results.z = {z_point};
+                results.outer = {store.get(config, z_point, 1, n)};
+                results.inner.resize(1);
+                if (config.detector_type == "annular"){
+                    results.inner[0] = store.get(config, z_point, 1 / config.det_fraction, n);
+                }
+                point_result(results, 0, efficiency, rel_er);
+
+                std::ostringstream answer;
+                answer << exact_str(z_point) << "\t" << efficiency << "\t" << rel_er << "\t"
+                       << results.outer[0].N_hit << "\t" << results.inner[0].N_hit << "\t" << results.outer[0].n << "\n";
+                {
+                    std::lock_guard<std::mutex> lock(send_mutex);
+                    send_all(fd, answer.str());
+                }
+                std::lock_guard<std::mutex> lock(done_mutex);
+                if (--remaining == 0){
+                    all_done.notify_one();
+                }
+            });
+        }
+
+        std::unique_lock<std::mutex> lock(done_mutex);
+        all_done.wait(lock, [&](){ return remaining == 0; });
+        lock.unlock();
+        std::lock_guard<std::mutex> send_lock(send_mutex);
+        send_all(fd, "end\n");
+    }
+}
+
+
+// Long-running query server on a Unix domain socket: serve <socket path> [--threads <n>] [--cache <dir>]
+void serve(int argc, char **argv){
+    if (argc < 3){
+        std::cerr << "ERROR: usage 'serve <socket path> [--threads <n>] [--cache <dir>]'" << std::endl;
+        exit(0);
+    }
+
+    std::string socket_path = argv[2];
+    int n_threads = std::max((int) std::thread::hardware_concurrency(), 1);
+    counts_store store;
+    for (int i = 3; i < argc; i++){
+        std::string flag = argv[i];
+        if (flag == "--threads" && i + 1 < argc){
+            n_threads = std::max(atoi(argv[++i]), 1);
+        } else if (flag == "--cache" && i + 1 < argc){
+            store.cache_dir = argv[++i];
+        } else{
+            std::cerr << "ERROR: unknown option " << flag << "; options are '--threads <n>', '--cache <dir>'" << std::endl;
+            exit(0);
+        }
+    }
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path)){
+        std::cerr << "ERROR: socket path is too long" << std::endl;
+        exit(0);
+    }
+    strcpy(address.sun_path, socket_path.c_str());
+
+    int server_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socket_path.c_str());                                            // Remove a socket left behind by an earlier server
+    if (server_fd < 0 || bind(server_fd, (struct sockaddr*) &address, sizeof(address)) != 0 || listen(server_fd, 64) != 0){
+        std::cerr << "ERROR: could not listen on " << socket_path << std::endl;
+        exit(0);
+    }
+
+    thread_pool pool(n_threads);
+    std::cout << "Listening on " << socket_path << " with " << n_threads << " threads" << std::endl;
+    while (true){
+        int client_fd = accept(server_fd, nullptr, nullptr);
+        if (client_fd >= 0){
+            std::thread(serve_client, client_fd, std::ref(pool), std::ref(store)).detach();
+        }
+    }
+}
+
+
+// Print interpolated values of a binary table: lookup <table> <z> [z ...]
+void lookup_table(int argc, char **argv){
+    if (argc < 4){
+        std::cerr << "ERROR: usage 'lookup <table.gtab> <z/rd> [z/rd ...]'" << std::endl;
+        exit(0);
+    }
+
+    geo_table_view table(argv[2]);
+    std::cout << "z/rd \t Model \t Uncertainty" << std::endl;
+    for (int i = 3; i < argc; i++){
+        double z = atof(argv[i]);
+        std::cout << z << "\t" << table.lookup(z, "value") << "\t" << table.lookup(z, "error") << "\n";
+    }
+}
+
+
+// Radial detector response R(r) from a file with lines '<r> <R>' (r in rd, ascending), linear in between and 0 outside the table
+struct radial_response {
+    std::vector<double> r, R;
+
+    radial_response(std::string filename){                                  // Constructor: read the table
+        std::ifstream myFile(filename);
+        double r_point, R_point;
+        while (myFile >> r_point >> R_point){
+            r.push_back(r_point);
+            R.push_back(R_point);
+        }
+        if (r.size() < 2 || r.front() < 0 || !std::is_sorted(r.begin(), r.end())){
+            std::cerr << "ERROR: response " << filename << " needs at least two '<r> <R>' lines with ascending r >= 0" << std::endl;
+            exit(0);
+        }
+    }
+
+    double operator()(double r_point) const {
+        if (r_point < r.front() || r_point > r.back()){
+            return 0;
+        }
+        size_t i = std::upper_bound(r.begin(), r.end(), r_point) - r.begin();
+        i = std::min(std::max(i, (size_t) 1), r.size() - 1);
+        double t = r[i] > r[i - 1] ? (r_point - r[i - 1]) / (r[i] - r[i - 1]) : 1;
+        return R[i - 1] + t * (R[i] - R[i - 1]);
+    }
+};
+
+
+// Efficiency with radial detector responses from the radial histogram of a run: response <output> <response> [response ...].
+// Every sample counts with R(r) at its landing radius, taken at the centre (in r^2) of its histogram bin, so any number of
+// response models is evaluated on the same samples without sampling again. The error is that of the mean of R over the samples.
+void apply_responses(int argc, char **argv){
+    if (argc < 4){
+        std::cerr << "ERROR: usage 'response <output of a run with --radial> <response file> [response file ...]'" << std::endl;
+        exit(0);
+    }
+    geo_results results = read_geo_file(argv[2]);
+    const geo_config& config = results.config;
+    if (config.radial_bins == 0){
+        std::cerr << "ERROR: " << argv[2] << " has no radial histogram; make it with '--radial <r_max,bins>'" << std::endl;
+        exit(0);
+    }
+    double bin = config.radial_max * config.radial_max / config.radial_bins, factor = hit_factor(config);
+
+    std::cout << "z/rd";
+    std::vector<std::vector<double>> weights;
+    for (int f = 3; f < argc; f++){
+        radial_response response(argv[f]);
+        if (response.r.back() > config.radial_max && response(config.radial_max) != 0){
+            std::cerr << "WARNING: " << argv[f] << " goes beyond the histogram (r_max = " << config.radial_max << " rd); landings beyond it count as 0" << std::endl;
+        }
+        std::vector<double> bin_weights(config.radial_bins);
+        for (int k = 0; k < config.radial_bins; k++){
+            bin_weights[k] = response(sqrt((k + 0.5) * bin));
+        }
+        weights.push_back(bin_weights);
+        std::cout << " \t " << argv[f] << " \t Uncertainty";
+    }
+    std::cout << std::endl;
+
+    for (int i = 0; i < results.z.size(); i++){
+        double n = results.outer[i].n;
+        std::cout << results.z[i];
+        for (const std::vector<double>& bin_weights : weights){
+            double sum = 0, sum_sq = 0;
+            for (int k = 0; k < config.radial_bins; k++){
+                sum += results.radial_hits[i][k] * bin_weights[k];
+                sum_sq += results.radial_hits[i][k] * bin_weights[k] * bin_weights[k];
+            }
+            double mean = sum / n;
+            std::cout << "\t" << factor * mean << "\t" << factor * sqrt(std::max(sum_sq / n - mean * mean, 0.0) / n);
+        }
+        std::cout << "\n";
+    }
+}
+
+
+#ifdef GEO_PROFILE
+// Write the profile of the run as JSON: totals per phase, counters and the load of every thread
+void write_profile(std::string filename, double wall_total){
+    std::lock_guard<std::mutex> lock(profile_mutex);
+    std::ofstream myFile(filename);
+    double wall[profile_n_phases] = {0}, cpu[profile_n_phases] = {0}, busy_max = 0, busy_sum = 0;
+    long long samples = 0, hits = 0, buffer_bytes = 0;
+    int workers = 0;
+
+    for (auto& thread : profile_threads){
+        double busy = 0;
+        for (int p = 1; p < profile_n_phases; p++){
+            wall[p] += thread->wall[p];
+            cpu[p] += thread->cpu[p];
+            busy += thread->wall[p];
+        }
+        samples += thread->samples;
+        hits += thread->hits;
+        buffer_bytes += thread->buffer_bytes;
+        if (thread->samples > 0){                                            // Load balance only over threads that sampled
+            busy_max = std::max(busy_max, busy);
+            busy_sum += busy;
+            workers++;
+        }
+    }
+
+    myFile << "{\n  \"wall_seconds\": " << wall_total << ",\n  \"phases\": {";
+    for (int p = 1; p < profile_n_phases; p++){
+        myFile << (p > 1 ? "," : "") << "\n    \"" << profile_phase_names[p] << "\": {\"wall_seconds\": " << wall[p] << ", \"cpu_seconds\": " << cpu[p] << "}";
+    }
+    myFile << "\n  },\n  \"samples_generated\": " << samples << ",\n  \"hits\": " << hits << ",\n  \"estimated_buffer_bytes\": " << buffer_bytes << ",\n";
+    myFile << "  \"load_balance\": " << (busy_max > 0 ? busy_sum / workers / busy_max : 1) << ",\n  \"threads\": [";
+    for (int t = 0; t < profile_threads.size(); t++){
+        const profile_thread& thread = *profile_threads[t];
+        double busy_wall = 0, busy_cpu = 0;
+        for (int p = 1; p < profile_n_phases; p++){
+            busy_wall += thread.wall[p];
+            busy_cpu += thread.cpu[p];
+        }
+        myFile << (t > 0 ? "," : "") << "\n    {\"wall_seconds\": " << busy_wall << ", \"cpu_seconds\": " << busy_cpu
+               << ", \"samples\": " << thread.samples << ", \"hits\": " << thread.hits << "}";
+    }
+    myFile << "\n  ]\n}\n";
+    std::cout << "Wrote profile " << filename << std::endl;
 }
+#endif
 
 
 int main(int argc, char **argv){
-    int seed = 15763027;                                                    // Randomly picked seed
+    geo_config config;
+    geo_results results;
     std::string source_type, detector_type;
-    double z_min, z_max, source, result, det_fraction;
-    int n_points, power;
-    std::string filename;
+    double z_min, z_max, source, det_fraction = 1, target_rel_er = 0, checkpoint_interval = 60;
+    int n_points, power = 0, n_threads = 1;
+    std::string filename, cache_dir, refine_file, resume_file;
+    std::vector<long long> n_targets;
+    int shard = 0, n_shards = 1;
+    bool derivatives = false, single_precision = false;
+    std::string profile_file, offset, tilt, emission, depth, landing, radial, interval;
+    bool emission_weighted = false;
+    std::vector<aperture> apertures;
+#ifdef GEO_PROFILE
+    auto run_start = std::chrono::steady_clock::now();
+#endif
+
+    if (argc > 1 && std::string(argv[1]) == "lookup"){
+        lookup_table(argc, argv);
+        return 1;
+    }
+    if (argc > 1 && std::string(argv[1]) == "merge"){
+        merge_shards(argc, argv);
+        return 1;
+    }
+    if (argc > 1 && std::string(argv[1]) == "serve"){
+        serve(argc, argv);
+        return 1;
+    }
+    if (argc > 1 && std::string(argv[1]) == "inverse"){
+        inverse_fit(argc, argv);
+        return 1;
+    }
+    if (argc > 1 && std::string(argv[1]) == "multi"){
+        multi_detector(argc, argv);
+        return 1;
+    }
+    if (argc > 1 && std::string(argv[1]) == "response"){
+        apply_responses(argc, argv);
+        return 1;
+    }
+    if (argc > 1 && std::string(argv[1]) == "threshold"){
+        threshold_query(argc, argv);
+        return 1;
+    }
+    if (argc > 1 && std::string(argv[1]) == "offsetmap"){
+        offset_map(argc, argv);
+        return 1;
+    }
 
     // Check if the arguments were appropriate
-    if (argc != 3){
-        std::cerr << "ERROR: input option 'uniform' or 'gaussian' for the source distribution and 'circular' or 'annular' for the detector" << std::endl;
+    if (argc < 3){
+        std::cerr << "ERROR: input option 'uniform', 'gaussian' or 'map' for the source distribution and 'circular', 'annular', 'rectangular' or 'pixelated' for the detector" << std::endl;
         exit(0);
     } else{
         source_type = argv[1];
         detector_type = argv[2];
 
-        if (source_type != "uniform" && source_type != "gaussian"){
-            std::cerr << "ERROR: input option 'uniform' or 'gaussian' for the source distribution" << std::endl;
+        if (source_type != "uniform" && source_type != "gaussian" && source_type != "map"){
+            std::cerr << "ERROR: input option 'uniform', 'gaussian' or 'map' for the source distribution" << std::endl;
             exit(0);
         }
-        else if (detector_type != "circular" && detector_type != "annular"){
-            std::cerr << "ERROR: input option 'circular' or 'annular' for the source distribution" << std::endl;
+        else if (detector_type != "circular" && detector_type != "annular" && detector_type != "rectangular" && detector_type != "pixelated"){
+            std::cerr << "ERROR: input option 'circular', 'annular', 'rectangular' or 'pixelated' for the detector" << std::endl;
             exit(0);
         }
     }
 
-    // Input values
-    std::cout << "z_min/rd:" << std::endl;
-    std::cin >> z_min;
-    std::cout << "z_max/rd:" << std::endl;
-    std::cin >> z_max;
-    std::cout << "number of points:" << std::endl;
-    std::cin >> n_points;
-    std::cout << "source/rd:" << std::endl;
-    std::cin >> source;
-    std::cout << "Power:" << std::endl;
-    std::cin >> power;
-    if (detector_type == "annular"){
-        std::cout << "Detector outer/inner:" << std::endl;
-        std::cin >> det_fraction;
+    // Optional flags
+    for (int i = 3; i < argc; i++){
+        std::string flag = argv[i];
+        if (flag == "--cache" && i + 1 < argc){
+            cache_dir = argv[++i];
+        } else if (flag == "--refine" && i + 1 < argc){
+            refine_file = argv[++i];
+        } else if (flag == "--resume" && i + 1 < argc){
+            resume_file = argv[++i];
+        } else if (flag == "--checkpoint" && i + 1 < argc){
+            checkpoint_interval = atof(argv[++i]);
+        } else if (flag == "--threads" && i + 1 < argc){
+            n_threads = std::max(atoi(argv[++i]), 1);
+        } else if (flag == "--shard" && i + 1 < argc){
+            if (sscanf(argv[++i], "%d/%d", &shard, &n_shards) != 2 || n_shards < 1 || shard < 0 || shard >= n_shards){
+                std::cerr << "ERROR: --shard expects i/N with 0 <= i < N" << std::endl;
+                exit(0);
+            }
+        } else if (flag == "--derivatives"){
+            derivatives = true;
+        } else if (flag == "--float"){
+            single_precision = true;
+        } else if (flag == "--offset" && i + 1 < argc){
+            offset = argv[++i];
+        } else if (flag == "--aperture" && i + 1 < argc){
+            std::vector<aperture> added = parse_apertures(argv[++i]);
+            apertures.insert(apertures.end(), added.begin(), added.end());
+        } else if (flag == "--emission" && i + 1 < argc){
+            emission = argv[++i];
+        } else if (flag == "--weighted"){
+            emission_weighted = true;
+        } else if (flag == "--depth" && i + 1 < argc){
+            depth = argv[++i];
+        } else if (flag == "--landing" && i + 1 < argc){
+            landing = argv[++i];
+        } else if (flag == "--radial" && i + 1 < argc){
+            radial = argv[++i];
+        } else if (flag == "--interval" && i + 1 < argc){
+            interval = argv[++i];
+            if (interval != "wilson" && interval != "clopper-pearson"){
+                std::cerr << "ERROR: --interval is 'wilson' or 'clopper-pearson'" << std::endl;
+                exit(0);
+            }
+        } else if (flag == "--tilt" && i + 1 < argc){
+            tilt = argv[++i];
+        } else if (flag == "--profile" && i + 1 < argc){
+            profile_file = argv[++i];
+#ifndef GEO_PROFILE
+            std::cerr << "ERROR: --profile needs a build with profiling compiled in (g++ -DGEO_PROFILE ...)" << std::endl;
+            exit(0);
+#endif
+        } else{
+            std::cerr << "ERROR: unknown option " << flag << "; options are '--cache <dir>', '--refine <previous output>', '--resume <checkpoint>', '--checkpoint <seconds>', '--threads <n>', '--shard <i/N>', '--derivatives' (z/rd > 0), '--float', '--offset <dx,dy>', '--tilt <degrees[,azimuth]>', '--aperture <z,radius[,dx,dy]>', '--emission <legendre:a1,a2,...|table:file>', '--weighted', '--depth <uniform:t|exponential:mean|table:file>', '--landing <extent,bins>', '--radial <r_max,bins>', '--interval <wilson|clopper-pearson>', '--profile <file.json>'" << std::endl;
+            exit(0);
+        }
+    }
+    if ((offset != "" || tilt != "" || !apertures.empty() || emission != "" || depth != "" || landing != "" || radial != "") && (resume_file != "" || refine_file != "")){
+        std::cerr << "ERROR: a resumed or refined run keeps the offset, tilt, apertures, emission, depth and histograms stored in its file" << std::endl;
+        exit(0);
+    }
+    if (n_shards > 1 && cache_dir != ""){
+        std::cerr << "WARNING: shards do not use the cache" << std::endl;
     }
-    std::cout << "Filename:" << std::endl;
-    std::cin >> filename;
 
-    int n_perpoint = pow(10, power);
-    std::vector<double> z = linspace(z_min, z_max, n_points);
-    std::vector<double> efficiencies(n_points), rel_ers(n_points), efficiencies_outer(n_points), efficiencies_inner(n_points), rel_ers_outer(n_points), rel_ers_inner(n_points);
-    std::cout << "Completion(%)" << "\t" << "Efficiency (%)" << "\t \t" << "Relative error (%)" << std::endl;
+    if (resume_file != ""){
+        // Continue an interrupted run exactly where its last checkpoint left it, nothing is asked
+        read_checkpoint(resume_file, results, n_targets, target_rel_er, filename);
+        if (results.config.source_type != source_type || results.config.detector_type != detector_type){
+            std::cerr << "ERROR: " << resume_file << " was made with '" << results.config.source_type << " " << results.config.detector_type << "'" << std::endl;
+            exit(0);
+        }
+        n_points = results.z.size();
+    } else if (refine_file != ""){
+        // Continue a previous run: its parameters and counts come from the file, only the sample target is asked
+        results = read_geo_file(refine_file);
+        if (results.config.source_type != source_type || results.config.detector_type != detector_type){
+            std::cerr << "ERROR: " << refine_file << " was made with '" << results.config.source_type << " " << results.config.detector_type << "'" << std::endl;
+            exit(0);
+        }
+        n_points = results.z.size();
+        std::cout << "Power:" << std::endl;
+        std::cin >> power;
+        std::cout << "Target relative uncertainty (%, 0 for none):" << std::endl;
+        std::cin >> target_rel_er;
+        filename = refine_file;
+    } else{
+        // Input values
+        std::cout << "z_min/rd:" << std::endl;
+        std::cin >> z_min;
+        std::cout << "z_max/rd:" << std::endl;
+        std::cin >> z_max;
+        std::cout << "number of points:" << std::endl;
+        std::cin >> n_points;
+        if (source_type == "map"){
+            source = 0;
+            std::cout << "Source map file (raw float32):" << std::endl;
+            std::cin >> config.source_map_file;
+            std::cout << "Map pixels in x:" << std::endl;
+            std::cin >> config.map_x;
+            std::cout << "Map pixels in y:" << std::endl;
+            std::cin >> config.map_y;
+            std::cout << "Map pixel size/rd:" << std::endl;
+            std::cin >> config.map_pixel;
+        } else{
+            std::cout << "source/rd:" << std::endl;
+            std::cin >> source;
+        }
+        std::cout << "Power:" << std::endl;
+        std::cin >> power;
+        if (detector_type == "annular"){
+            std::cout << "Detector outer/inner:" << std::endl;
+            std::cin >> det_fraction;
+        }
+        if (detector_type == "rectangular" || detector_type == "pixelated"){
+            std::cout << "Detector height/width:" << std::endl;
+            std::cin >> config.det_height;
+        }
+        if (detector_type == "pixelated"){
+            std::cout << "Pixels in x:" << std::endl;
+            std::cin >> config.pixels_x;
+            std::cout << "Pixels in y:" << std::endl;
+            std::cin >> config.pixels_y;
+        }
+        std::cout << "Filename:" << std::endl;
+        std::cin >> filename;
 
-    // Calculate the geometric efficiency at all points
-    for (int i = 0; i < n_points; i++){
-        if (detector_type == "circular"){ 
-            efficiencies[i] = geom_eff_point(z[i], source, n_perpoint, seed, source_type);
-            rel_ers[i] = 100 / sqrt(2 * n_perpoint*efficiencies[i]/100);
+        config.source_type = source_type;
+        config.detector_type = detector_type;
+        config.source = source;
+        config.det_fraction = det_fraction;
+        config.shard = shard;
+        config.n_shards = n_shards;
+        config.derivatives = derivatives;
+        config.single_precision = single_precision;
+        if (offset != ""){
+            parse_offset(offset, config);
+        }
+        config.apertures = apertures;
+        config.emission = emission;
+        config.emission_weighted = emission_weighted;
+        config.depth = depth;
+        if (landing != "" && (sscanf(landing.c_str(), "%lf,%d", &config.landing_extent, &config.landing_bins) != 2
+                              || !(config.landing_extent > 0) || config.landing_bins < 1)){
+            std::cerr << "ERROR: --landing expects extent,bins: the half width of the histogram in rd and the number of bins per axis" << std::endl;
+            exit(0);
+        }
+        if (radial != "" && (sscanf(radial.c_str(), "%lf,%d", &config.radial_max, &config.radial_bins) != 2
+                             || !(config.radial_max > 0) || config.radial_bins < 1)){
+            std::cerr << "ERROR: --radial expects r_max,bins: the largest landing radius in rd and the number of bins in r^2" << std::endl;
+            exit(0);
         }
-        else if (detector_type == "annular") { 
-            efficiencies_outer[i] = geom_eff_point(z[i], source, n_perpoint, seed, source_type);
-            efficiencies_inner[i] = geom_eff_point(z[i] * det_fraction, source * det_fraction, n_perpoint, seed, source_type);
-            efficiencies[i] = efficiencies_outer[i] - efficiencies_inner[i];
-            rel_ers_outer[i] = 100 / sqrt(2 * n_perpoint*efficiencies_outer[i]/100);
-            rel_ers_inner[i] = 100 / sqrt(2 * n_perpoint*efficiencies_inner[i]/100);
-            rel_ers[i] = sqrt(rel_ers_outer[i] * rel_ers_outer[i] + rel_ers_inner[i] * rel_ers_inner[i]);
+        if (emission_weighted && emission == ""){
+            std::cerr << "ERROR: '--weighted' needs an emission model, '--emission <model>'" << std::endl;
+            exit(0);
         }
-        else{
-            std::cerr << "ERROR: Detector types can only be circular/annular" << std::endl;
+        if (tilt != "" && sscanf(tilt.c_str(), "%lf,%lf", &config.tilt, &config.tilt_azimuth) < 1){
+            std::cerr << "ERROR: --tilt expects the tilt angle in degrees, optionally followed by ,azimuth in degrees" << std::endl;
             exit(0);
         }
+        results.config = config;
+        results.z = linspace(z_min, z_max, n_points);
+    }
+    std::string invalid = validate_config(results.config, results.z);
+    if (invalid != ""){
+        std::cerr << "ERROR: " << invalid << std::endl;
+        exit(0);
+    }
+    if (resume_file == "" && refine_file == ""){                            // A new run starts from empty counts and maps
+        results.outer.resize(n_points);
+        results.inner.resize(n_points);
+        if (detector_type == "pixelated"){
+            results.pixel_hits.assign(n_points, std::vector<long long>(config.pixels_x * config.pixels_y, 0));
+        }
+        if (config.landing_bins > 0){
+            results.landing_hits.assign(n_points, std::vector<long long>(config.landing_bins * config.landing_bins, 0));
+        }
+        if (config.radial_bins > 0){
+            results.radial_hits.assign(n_points, std::vector<long long>(config.radial_bins, 0));
+        }
+    }
+    if (results.config.emission != ""){
+        load_emission_model(results.config.emission);                       // Check the model and build its tables once
+    }
+    if (results.config.depth != ""){
+        load_depth_model(results.config.depth);                             // Check the profile once
+    }
+    if (results.config.source_type == "map"){
+        load_source_map(results.config.source_map_file, results.config.map_x, results.config.map_y, results.config.map_pixel);  // Check the map and build its alias table once
+    }
+    if (grid_detector(results.config) && cache_dir != ""){
+        std::cerr << "WARNING: rectangular and pixelated detectors do not use the cache" << std::endl;
+    }
+    bool histograms = results.config.landing_bins > 0 || results.config.radial_bins > 0;
+    if (histograms && cache_dir != ""){
+        std::cerr << "WARNING: runs with a landing or radial histogram do not use the cache" << std::endl;
+    }
 
-        std::cout << z[i]/z[n_points-1] << "\t" << efficiencies[i] << "\t \t" << rel_ers[i] << std::endl; 
+    if (interval != ""){                                                    // Only changes the reported intervals, also for refined and resumed runs
+        results.config.interval = interval;
     }
-    
-    // Write the output file
-    write_geo_file(z, efficiencies, rel_ers, filename);
+    if (resume_file == ""){
+        results.config.power = std::max(results.config.power, power);
+        results.config.n_perpoint = std::max(results.config.n_perpoint, llround(pow(10, power)));
+        n_targets.assign(n_points, 0);
+    }
+    long long n_perpoint = llround(pow(10, results.config.power));
+    long long n_streams = (n_perpoint + STREAM_SIZE - 1) / STREAM_SIZE;
+    if (results.config.n_shards > n_streams){                               // A shard without streams would have no samples at all
+        std::cerr << "ERROR: 10^" << results.config.power << " samples per point are " << n_streams << " RNG stream(s) of " << STREAM_SIZE
+                  << "; use --shard i/N with N <= " << n_streams << std::endl;
+        exit(0);
+    }
+    std::mutex results_mutex;                                              // Guards results and n_targets while threads are running
+    auto last_checkpoint = std::chrono::steady_clock::now();
+    auto checkpoint = [&](){
+        std::lock_guard<std::mutex> lock(results_mutex);
+        if (checkpoint_interval > 0 && std::chrono::steady_clock::now() - last_checkpoint >= std::chrono::duration<double>(checkpoint_interval)){
+            write_checkpoint(results, n_targets, target_rel_er, filename);
+            last_checkpoint = std::chrono::steady_clock::now();
+        }
+    };
+    std::cout << "Completion(%)" << "\t" << "Efficiency (%)" << "\t \t" << "Relative error (%)" << std::endl;
+    point_writer writer(results, filename, 1.0);
+
+    // Calculate the geometric efficiency at all points; every thread takes the next unstarted point
+    std::atomic<int> next_point(0);
+    auto worker = [&](){
+        double efficiency, rel_er;
+        for (int i = next_point++; i < n_points; i = next_point++){
+            long long n_target;
+            {
+                std::lock_guard<std::mutex> lock(results_mutex);
+                if (n_targets[i] == 0){                                     // Decide the sample target once, so a resumed run makes the same choice
+                    n_targets[i] = n_perpoint;
+                    if (target_rel_er > 0 && results.outer[i].n > 0){       // Only add the samples needed to reach the target, rel_er ~ 1/sqrt(n)
+                        point_result(results, i, efficiency, rel_er);
+                        if (std::isfinite(rel_er)){                         // A shard holds about 1/n_shards of the samples of the run
+                            n_targets[i] = std::min(n_targets[i], (long long) ceil(results.config.n_shards * results.outer[i].n * pow(rel_er / target_rel_er, 2)));
+                        }
+                    }
+                }
+                n_target = n_targets[i];
+            }
+            run_point(results, i, n_target, cache_dir, checkpoint, &results_mutex);
+            writer.push(results, i);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int t = 1; t < n_threads; t++){
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (std::thread& thread : threads){
+        thread.join();
+    }
+    writer.finish();
+
+    // With a target the points may stop before 10^Power samples: the header then claims only the largest sample count reached
+    if (target_rel_er > 0){
+        long long reached = 0;
+        for (int i = 0; i < n_points; i++){
+            reached = std::max({reached, n_targets[i], std::min(results.config.n_shards * results.outer[i].n, n_perpoint)});
+        }
+        if (reached < n_perpoint){
+            results.config.n_perpoint = reached;
+            results.config.power = (int) floor(log10(std::max(reached, 1LL)) + 1e-9);
+        }
+    }
+
+    // Write the output file, the checkpoint is no longer needed
+    write_geo_file(results, filename);
+    remove((filename + ".ckpt").c_str());
+#ifdef GEO_PROFILE
+    if (profile_file != ""){
+        write_profile(profile_file, std::chrono::duration<double>(std::chrono::steady_clock::now() - run_start).count());
+    }
+#endif
     return 1;
 }
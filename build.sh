@@ -13,7 +13,8 @@ else
 fi
 
 echo "build dir: $DIR"
-g++ -std=c++17 -O3 -finline-functions Isotropic_emission.cpp -o build/isotropic.exe;
+g++ -std=c++17 -O3 -finline-functions -pthread Isotropic_emission.cpp -o build/isotropic.exe;
+#g++ -std=c++17 -O3 -finline-functions -pthread -DGEO_PROFILE Isotropic_emission.cpp -o build/isotropic_profile.exe;
 #cmake . -B${DIR} -DCMAKE_BUILD_TYPE=${CMAKE_BUILD_TYPE}; cd ${DIR}; make VERBOSE=1
 
 
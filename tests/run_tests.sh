@@ -0,0 +1,418 @@
+#!/bin/bash
+
+# Regression checks for the output files and subcommands, from main path: "./tests/run_tests.sh"
+# The program is built in a temporary directory and every check runs a small input (Power 5 to 7) there
+# The checks compare hit counts or printed values; the number of failed checks is the exit code
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK"
+
+echo "building in ${WORK}..."
+g++ -std=c++17 -O3 -finline-functions -pthread "$ROOT/Isotropic_emission.cpp" -o isotropic.exe 2> /dev/null || { echo "build failed"; exit 1; }
+
+n_failed=0
+
+# Report one check; the remaining arguments are the command that decides it
+check(){
+    local name=$1
+    shift
+    if "$@"; then
+        echo "PASS  $name"
+    else
+        echo "FAIL  $name"
+        n_failed=$((n_failed + 1))
+    fi
+}
+
+# Run the program with the answers to its prompts (printf format) as first argument
+run(){
+    local input=$1
+    shift
+    printf "$input" | ./isotropic.exe "$@" 2>&1
+}
+
+# Columns z/rd, N_hit, N_hit inner, Samples and Samples inner of a text output
+counts(){
+    awk -F'\t' 'NR > 2 {print $1, $5, $6, $7, $8}' "$1"
+}
+
+same_counts(){
+    [ "$(counts "$1")" == "$(counts "$2")" ]
+}
+
+# True if two text outputs have the same samples and their hits differ by at most 1 + 1e-6 relative, the edge band of the float kernel
+near_counts(){
+    awk -F'\t' 'NR == FNR && FNR > 2 {hits[FNR] = $5; inner[FNR] = $6; n[FNR] = $7}
+                NR > FNR && FNR > 2 && (($5 - hits[FNR]) ^ 2 > (1 + 1e-6 * $5) ^ 2 || ($6 - inner[FNR]) ^ 2 > (1 + 1e-6 * $6) ^ 2 || $7 != n[FNR]) {exit 1}' "$1" "$2"
+}
+
+# Negate a check
+not(){
+    ! "$@"
+}
+
+# True if |a - b| <= tol
+near(){
+    awk -v a="$1" -v b="$2" -v tol="$3" 'BEGIN {d = a - b; exit !(d <= tol && -d <= tol)}'
+}
+
+# True if the Model column of a text output is within 3 sigma of the point source column, on exactly <rows> rows
+within_sigma(){
+    awk -F'\t' -v rows="$2" 'NR > 2 && ($3 - $2) ^ 2 > (0.03 * $3 * $4) ^ 2 {far = 1} END {exit far || NR != rows + 2}' "$1"
+}
+
+# Header value of a .gtab file
+gtab_key(){
+    local header_length=$(od -An -tu4 -j12 -N4 "$1" | tr -d ' ')
+    dd if="$1" bs=1 skip=16 count="$header_length" 2> /dev/null | tr -d '\0' | sed -n "s/^$2=//p"
+}
+
+# One array of a .gtab file, one value per line
+gtab_array(){
+    local header_length=$(od -An -tu4 -j12 -N4 "$1" | tr -d ' ')
+    local size=1 n_axis_values=0 index=0 found=0 n a
+    for n in $(gtab_key "$1" shape | tr ',' ' '); do
+        size=$((size * n))
+        n_axis_values=$((n_axis_values + n))
+    done
+    for a in $(gtab_key "$1" arrays | tr ',' ' '); do
+        [ "$a" == "$2" ] && { found=1; break; }
+        index=$((index + 1))
+    done
+    [ $found == 1 ] || return
+    od -An -tf8 -v -w8 -j $((16 + header_length + 8 * (n_axis_values + index * size))) -N $((8 * size)) "$1" | awk '{print $1 + 0}'
+}
+
+# Sum of one array of a .gtab file
+gtab_sum(){
+    gtab_array "$1" "$2" | awk '{s += $1} END {printf "%.0f\n", s}'
+}
+
+# True if an array is present and equal in two .gtab files
+same_array(){
+    local values=$(gtab_array "$1" "$3")
+    [ -n "$values" ] && [ "$values" == "$(gtab_array "$2" "$3")" ]
+}
+
+
+# Binary tables: the same counts and values as the text output, written without leftovers
+run "1\n2\n3\n0.5\n5\ndirect.txt\n" uniform circular > /dev/null
+run "1\n2\n3\n0.5\n5\ntable.gtab\n" uniform circular > /dev/null
+./isotropic.exe merge table.txt table.gtab > /dev/null
+check "gtab: converts back to the text output" cmp -s direct.txt table.txt
+check "gtab: hits array" [ "$(gtab_array table.gtab hits | tr '\n' ' ')" == "$(awk -F'\t' 'NR > 2 {printf "%s ", $5}' direct.txt)" ]
+check "gtab: value array" [ "$(gtab_array table.gtab value | tr '\n' ' ')" == "$(awk -F'\t' 'NR > 2 {printf "%s ", $3}' direct.txt)" ]
+check "gtab: header" [ "$(gtab_key table.gtab n_perpoint)" == 100000 ]
+check "gtab: no temporary file left" [ -z "$(ls | grep '\.tmp$')" ]
+check "lookup: value at a grid point" [ "$(./isotropic.exe lookup table.gtab 1.5 | awk 'NR == 2 {print $2}')" == "$(awk -F'\t' 'NR == 4 {print $3}' direct.txt)" ]
+
+
+# Result cache: a repeated run reads its entries, and a run with more samples only adds the missing ones
+run "1\n2\n2\n0.5\n5\n2\ncached_5.txt\n" uniform annular --cache cache > /dev/null
+run "1\n2\n2\n0.5\n6\n2\ncached_6.txt\n" uniform annular --cache cache > /dev/null
+run "1\n2\n2\n0.5\n6\n2\ndirect_6.txt\n" uniform annular > /dev/null
+check "cache: extended entries give the counts of a direct run" same_counts cached_6.txt direct_6.txt
+check "cache: entries hold the new sample count" [ "$(awk 'FNR == 2 && $2 != 1000000' cache/*.txt)" == "" ]
+entry=$(grep -l "radius=1;z=2;" cache/*.txt)
+awk 'FNR == 2 {$1 = $1 + 1} {print}' OFS='\t' "$entry" > entry.txt && mv entry.txt "$entry"
+run "1\n2\n2\n0.5\n6\n2\ncached_6.txt\n" uniform annular --cache cache > /dev/null
+check "cache: a repeated run reads the entries" [ "$(awk -F'\t' 'NR == 4 {print $5}' cached_6.txt)" == $(($(awk -F'\t' 'NR == 4 {print $5}' direct_6.txt) + 1)) ]
+
+
+# Refine: continuing a run gives the counts of a direct run, and a target stops every distance near it
+run "1\n2\n2\n0.5\n5\n2\nrefined.txt\n" uniform annular > /dev/null
+run "6\n0\n" uniform annular --refine refined.txt > /dev/null
+check "refine: counts of a direct run" same_counts refined.txt direct_6.txt
+run "1\n2\n2\n0.5\n5\ntarget.txt\n" uniform circular > /dev/null
+run "7\n0.5\n" uniform circular --refine target.txt > /dev/null
+check "refine: target uncertainty reached" [ "$(awk -F'\t' 'NR > 2 && ($4 > 0.51 || $7 >= 10000000)' target.txt)" == "" ]
+check "refine: header records the samples reached" [ "$(head -1 target.txt | grep -o 'n_perpoint=[0-9]*')" == "n_perpoint=$(awk -F'\t' 'NR > 2 && $7 > n {n = $7} END {print n}' target.txt)" ]
+
+
+# Checkpoints: a run killed after its first checkpoint and resumed gives the counts of an uninterrupted run
+run "1\n2\n2\n0.5\n7\ndirect_7.txt\n" uniform circular > /dev/null
+printf "1\n2\n2\n0.5\n7\nresumed.txt\n" | ./isotropic.exe uniform circular --checkpoint 0.5 > /dev/null 2>&1 &
+for i in $(seq 100); do
+    [ -f resumed.txt.ckpt ] && break
+    sleep 0.1
+done
+kill -9 $! 2> /dev/null
+wait $! 2> /dev/null
+check "checkpoint: written during the run" [ -f resumed.txt.ckpt ]
+./isotropic.exe uniform circular --resume resumed.txt.ckpt > /dev/null 2>&1
+check "checkpoint: resume gives the counts of an uninterrupted run" same_counts resumed.txt direct_7.txt
+check "checkpoint: removed after the output is written" [ ! -f resumed.txt.ckpt ]
+
+
+# Threads and partial output: the counts do not depend on the number of threads, and the partial file is removed at the end
+run "1\n2\n2\n0.5\n6\n2\nthreads.txt\n" uniform annular --threads 2 > /dev/null
+check "threads: counts of a single-thread run" same_counts threads.txt direct_6.txt
+check "threads: partial file removed" [ ! -f threads.txt.partial ]
+
+
+# Shards: merged shard outputs give the counts of a single run, and a missing shard or a shard without streams is refused
+run "1\n2\n2\n0.5\n7\nshard_0.txt\n" uniform circular --shard 0/2 > /dev/null
+run "1\n2\n2\n0.5\n7\nshard_1.gtab\n" uniform circular --shard 1/2 > /dev/null
+./isotropic.exe merge merged.txt shard_0.txt shard_1.gtab > /dev/null 2>&1
+check "merge: counts of a single run" same_counts merged.txt direct_7.txt
+check "merge: missing shard refused" grep -q ERROR <(./isotropic.exe merge missing.txt shard_0.txt 2>&1)
+check "merge: nothing written for a missing shard" [ ! -f missing.txt ]
+check "shard: more shards than streams refused" grep -q ERROR <(run "1\n2\n2\n0.5\n5\nshard_empty.txt\n" uniform circular --shard 1/2)
+
+
+# Query server: the answers have the counts of a direct run, also when repeated, and a malformed or invalid query gets an error line
+# The client needs python3; without it these checks are skipped
+query(){
+    python3 - "$@" << 'PY'
+import socket, sys
+client = socket.socket(socket.AF_UNIX)
+client.connect(sys.argv[1])
+client.sendall("".join(line + "\n" for line in sys.argv[2:]).encode())
+answer = b""
+while answer.count(b"end\n") + answer.count(b"error") < len(sys.argv) - 2:
+    answer += client.recv(4096)
+print(answer.decode(), end="")
+PY
+}
+if command -v python3 > /dev/null; then
+    ./isotropic.exe serve "$WORK/geo.sock" --threads 2 > /dev/null 2>&1 &
+    server=$!
+    for i in $(seq 100); do
+        [ -S geo.sock ] && break
+        sleep 0.1
+    done
+    query "$WORK/geo.sock" "uniform annular 0.5 2 6 1 2" "uniform annular 0.5 2 6 2 1" > answers.txt
+    expected=$(awk -F'\t' 'NR > 2 {print $1, $5, $6, $7}' direct_6.txt)
+    check "serve: counts of a direct run" [ "$(grep -v end answers.txt | head -2 | sort -n | awk '{print $1, $4, $5, $6}')" == "$expected" ]
+    check "serve: repeated query" [ "$(grep -v end answers.txt | tail -2 | sort -n | awk '{print $1, $4, $5, $6}')" == "$expected" ]
+    check "serve: malformed query" grep -q "^error" <(query "$WORK/geo.sock" "uniform square 0.5 1 6 1")
+    check "serve: negative source refused" grep -q "^error source/rd" <(query "$WORK/geo.sock" "uniform circular -0.5 1 5 1")
+    check "serve: inverted annulus refused" grep -q "^error detector outer/inner" <(query "$WORK/geo.sock" "uniform annular 0.5 0.5 5 1")
+    check "serve: negative distance refused" grep -q "^error z/rd" <(query "$WORK/geo.sock" "uniform circular 0.5 1 5 -1")
+    kill $server
+    wait $server 2> /dev/null
+else
+    echo "SKIP  serve: no python3 for the socket client"
+fi
+
+
+# Inverse fit: the efficiency of a direct run at z/rd = 1 and source/rd = 0.5 is fitted back to those values, and invalid fixed parameters are refused before the fit
+measured=$(awk -F'\t' 'NR == 3 {print $3, $3 * $4 / 100}' direct.txt)
+fit=$(run "z\n${measured% *}\n${measured#* }\n0.5\n0.5\n2\n6\n" inverse uniform circular | awk -F'\t' '/^Fitted/ {split($2, f, " "); print f[1], f[3]}')
+check "inverse: fitted z/rd" near "${fit% *}" 1 "$(awk -v e="${fit#* }" 'BEGIN {print 3 * e}')"
+fit=$(run "source\n${measured% *}\n${measured#* }\n1\n0.1\n1\n6\n" inverse uniform circular | awk -F'\t' '/^Fitted/ {split($2, f, " "); print f[1], f[3]}')
+check "inverse: fitted source/rd" near "${fit% *}" 0.5 "$(awk -v e="${fit#* }" 'BEGIN {print 3 * e}')"
+check "inverse: annulus without a ring refused" grep -q "ERROR: detector outer/inner" <(run "z\n${measured% *}\n${measured#* }\n0.5\n0.5\n2\n5\n0.5\n" inverse uniform annular)
+check "inverse: negative fixed source refused" grep -q "ERROR: source/rd" <(run "z\n${measured% *}\n${measured#* }\n-0.5\n0.5\n2\n5\n" inverse uniform circular)
+check "inverse: negative fixed z refused" grep -q "ERROR: z/rd" <(run "source\n${measured% *}\n${measured#* }\n-1\n0.1\n1\n5\n" inverse uniform circular)
+
+
+# Derivatives: dE/dz agrees with a finite difference of the efficiency, z/rd = 0 is refused, and the score statistics survive a refine of a .gtab output
+run "0.9\n1.1\n3\n0.5\n6\nderivatives.txt\n" uniform circular --derivatives > /dev/null
+check "derivatives: dE/dz against a finite difference" awk -F'\t' 'NR == 3 {e1 = $3} NR == 4 {d = $9} NR == 5 {e2 = $3} END {exit !((e2 - e1) / 0.2 / d > 0.98 && (e2 - e1) / 0.2 / d < 1.02)}' derivatives.txt
+check "derivatives: z/rd = 0 refused" grep -q ERROR <(run "0\n1\n2\n0.5\n5\nderivatives_zero.txt\n" uniform circular --derivatives)
+run "0.9\n1.1\n3\n0.5\n5\nderivatives.gtab\n" uniform circular --derivatives > /dev/null
+run "6\n0\n" uniform circular --refine derivatives.gtab > /dev/null
+./isotropic.exe merge derivatives_refined.txt derivatives.gtab > /dev/null
+check "derivatives: refine gives the counts of a direct run" same_counts derivatives_refined.txt derivatives.txt
+check "derivatives: refine gives the derivatives of a direct run" awk -F'\t' 'NR == FNR && FNR > 2 {for (c = 9; c <= 12; c++) d[FNR, c] = $c} NR > FNR && FNR > 2 {for (c = 9; c <= 12; c++) if (($c - d[FNR, c]) ^ 2 > 1e-8 * $c ^ 2) exit 1}' derivatives_refined.txt derivatives.txt
+
+
+# Single precision: the float kernel gives the hit counts of the double-precision path up to samples in the edge band
+run "1\n2\n3\n0.5\n5\nfloat.txt\n" uniform circular --float > /dev/null
+check "float: uniform source counts" near_counts float.txt direct.txt
+run "1\n2\n2\n0.5\n6\n2\nfloat_gaussian.txt\n" gaussian annular --float > /dev/null
+run "1\n2\n2\n0.5\n6\n2\ndouble_gaussian.txt\n" gaussian annular > /dev/null
+check "float: gaussian source counts" near_counts float_gaussian.txt double_gaussian.txt
+run "1\n2\n2\n0.5\n7\nfloat_7.txt\n" uniform circular --float > /dev/null
+check "float: counts at Power 7" near_counts float_7.txt direct_7.txt
+
+
+# Profiling: a -DGEO_PROFILE build counts the samples and hits of the run, and a normal build refuses "--profile"
+g++ -std=c++17 -O3 -finline-functions -pthread -DGEO_PROFILE "$ROOT/Isotropic_emission.cpp" -o isotropic_profile.exe 2> /dev/null
+printf "1\n2\n3\n0.5\n5\nprofiled.txt\n" | ./isotropic_profile.exe uniform circular --profile profile.json > /dev/null 2>&1
+check "profile: same counts as a normal build" same_counts profiled.txt direct.txt
+check "profile: samples counted" grep -q "\"samples_generated\": 300000," profile.json
+check "profile: hits counted" grep -q "\"hits\": $(awk -F'\t' 'NR > 2 {n += $5} END {print n}' direct.txt)," profile.json
+check "profile: refused by a normal build" grep -q ERROR <(run "1\n2\n3\n0.5\n5\nprofiled.txt\n" uniform circular --profile profile.json)
+
+
+# Off-axis sources: a zero offset gives the coaxial counts, and a point source off the axis matches its solid angle
+run "1\n2\n3\n0.5\n5\noffset_zero.txt\n" uniform circular --offset 0,0 > /dev/null
+check "offset: zero offset counts" same_counts offset_zero.txt direct.txt
+run "0.5\n2\n3\n0\n6\noffset_point.txt\n" uniform circular --offset 0.7,0.3 > /dev/null
+check "offset: point source column within 3 sigma" within_sigma offset_point.txt 3
+
+
+# Rectangular and pixelated detectors: the pixel map adds up to the hits of the whole rectangle, a point source matches the solid angle, and empty detectors are refused
+run "1\n2\n2\n0.3\n5\n0.5\n4\n2\npixelated.txt\n" uniform pixelated > /dev/null
+run "1\n2\n2\n0.3\n5\n0.5\nrectangular.txt\n" uniform rectangular > /dev/null
+check "pixelated: counts of the rectangular detector" same_counts pixelated.txt rectangular.txt
+check "pixelated: pixel map shape" [ "$(gtab_key pixelated.txt.pixels.gtab shape)" == "2,2,4" ]
+check "pixelated: pixel hits add up to the hits" [ "$(gtab_sum pixelated.txt.pixels.gtab hits)" == "$(awk -F'\t' 'NR > 2 {n += $5} END {print n}' pixelated.txt)" ]
+run "0.5\n2\n3\n0\n6\n0.5\nrectangular_point.txt\n" uniform rectangular > /dev/null
+check "rectangular: point source column within 3 sigma" within_sigma rectangular_point.txt 3
+check "rectangular: zero height refused" grep -q ERROR <(run "1\n2\n2\n0.3\n5\n0\nrectangular_flat.txt\n" uniform rectangular)
+check "pixelated: no pixels refused" grep -q ERROR <(run "1\n2\n2\n0.3\n5\n0.5\n0\n2\npixelated_empty.txt\n" uniform pixelated)
+
+
+# Several detectors: each detector gets the hits of a separate run, the covariance diagonal holds the squared uncertainties, and a negative source is refused
+printf "# z outer inner offset_x offset_y\n1 1 0 0 0\n2 1 0.5 0 0\n" > detector_list.txt
+run "0.5\n5\nmulti.txt\n" multi uniform detector_list.txt > /dev/null
+run "1\n2\n2\n0.5\n5\n2\nannular_5.txt\n" uniform annular > /dev/null
+check "multi: circle hits of a separate run" near "$(awk -F'\t' 'NR == 3 {print $10}' multi.txt)" "$(awk -F'\t' 'NR == 3 {print $5}' direct.txt)" 2
+check "multi: ring hits of a separate run" near "$(awk -F'\t' 'NR == 4 {print $10}' multi.txt)" "$(awk -F'\t' 'NR == 4 {print $5 - $6}' annular_5.txt)" 2
+check "multi: covariance diagonal" awk -F'\t' 'NR == 3 {u0 = $9} NR == 4 {u1 = $9} NR == 6 {c0 = $1} NR == 7 {c1 = $2} END {exit !(c0 > 0 && c1 > 0 && (c0 - u0 ^ 2) ^ 2 < 1e-6 * c0 ^ 2 && (c1 - u1 ^ 2) ^ 2 < 1e-6 * c1 ^ 2)}' multi.txt
+check "multi: negative source refused" grep -q "ERROR: detector 0" <(printf -- "-0.5\n5\nmulti_negative.txt\n" | ./isotropic.exe multi uniform detector_list.txt 2>&1)
+
+
+# Tilted detectors: a vanishing tilt (zero itself takes the normal kernel) gives the counts of the normal kernel, a tilted disk matches its solid angle, and it may not reach the source plane
+run "1\n2\n3\n0.5\n5\ntilt_zero.txt\n" uniform circular --tilt 1e-12 > /dev/null
+check "tilt: vanishing tilt counts" same_counts tilt_zero.txt direct.txt
+run "1\n2\n2\n0.5\n6\n2\ntilt_zero_annular.txt\n" uniform annular --tilt 1e-12,30 > /dev/null
+check "tilt: vanishing tilt annular counts" same_counts tilt_zero_annular.txt direct_6.txt
+run "1\n2\n3\n0.5\n5\ntilt_zero_offset.txt\n" uniform circular --tilt 1e-12 --offset 0.7,0.3 > /dev/null
+run "1\n2\n3\n0.5\n5\ntilt_offset_direct.txt\n" uniform circular --offset 0.7,0.3 > /dev/null
+check "tilt: vanishing tilt off-axis counts" same_counts tilt_zero_offset.txt tilt_offset_direct.txt
+run "1\n2\n3\n0\n6\ntilt_point.txt\n" uniform circular --tilt 30,45 > /dev/null
+check "tilt: point source column within 3 sigma" within_sigma tilt_point.txt 3
+check "tilt: detector through the source plane refused" grep -q ERROR <(run "0.3\n2\n3\n0\n5\ntilt_close.txt\n" uniform circular --tilt 30)
+
+
+# Source maps: the alias table is written next to the map and rebuilt when the map changes, and a one-pixel map acts as a small square source
+for i in $(seq 16); do printf '\x00\x00\x80\x3f'; done > map.raw
+run "1\n2\n2\nmap.raw\n4\n4\n0.25\n5\nmap.txt\n" map circular > /dev/null
+check "map: alias table written" [ -f map.raw.alias ]
+cp map.txt map_first.txt
+cp map.raw.alias map_first.alias
+run "1\n2\n2\nmap.raw\n4\n4\n0.25\n5\nmap.txt\n" map circular > /dev/null
+check "map: repeated run" cmp -s map.txt map_first.txt
+printf '\x00\x00\x00\x40' | dd of=map.raw bs=1 conv=notrunc 2> /dev/null
+run "1\n2\n2\nmap.raw\n4\n4\n0.25\n5\nmap.txt\n" map circular > /dev/null
+check "map: alias table rebuilt for a changed map" not cmp -s map.raw.alias map_first.alias
+check "map: changed map sampled" not same_counts map.txt map_first.txt
+printf '\x00\x00\x80\x3f' > pixel.raw
+run "0.5\n2\n3\npixel.raw\n1\n1\n0.01\n6\npixel.txt\n" map circular > /dev/null
+check "map: one small pixel matches the point source within 3 sigma" within_sigma pixel.txt 3
+check "map: refused by the float kernel" grep -q ERROR <(run "1\n2\n2\nmap.raw\n4\n4\n0.25\n5\nmap_float.txt\n" map circular --float)
+
+
+# Apertures: a wide aperture changes nothing, and behind narrow coaxial or off-axis apertures a point source matches the aperture-limited solid angle
+run "1\n2\n3\n0.5\n5\naperture_wide.txt\n" uniform circular --aperture 0.5,100 > /dev/null
+check "aperture: wide aperture counts" same_counts aperture_wide.txt direct.txt
+run "1\n2\n3\n0\n6\naperture_narrow.txt\n" uniform circular --aperture 0.5,0.2 > /dev/null
+check "aperture: point source column within 3 sigma" within_sigma aperture_narrow.txt 3
+run "0.5\n2\n3\n0\n6\naperture_off_axis.txt\n" uniform circular --offset 0.7,0.3 --aperture 0.25,0.3,0.5,0.1 > /dev/null
+check "aperture: off-axis point source column within 3 sigma" within_sigma aperture_off_axis.txt 3
+run "0.5\n2\n3\n0\n6\n0.5\naperture_rectangular.txt\n" uniform rectangular --aperture 0.3,0.2,0.1,0.05 > /dev/null
+check "aperture: point source column of a rectangle within 3 sigma" within_sigma aperture_rectangular.txt 3
+
+
+# Anisotropic emission: sampled and weighted runs match the point source with W (also off the axis, behind an aperture and for a rectangle), a table gives the counts of the same Legendre model, and negative or malformed models are refused
+run "0.5\n2\n3\n0\n6\nlegendre.txt\n" uniform circular --emission legendre:0.5 > /dev/null
+check "emission: sampled point source within 3 sigma" within_sigma legendre.txt 3
+run "0.5\n2\n3\n0\n6\nlegendre_weighted.txt\n" uniform circular --emission legendre:0.5 --weighted > /dev/null
+check "emission: weighted point source within 3 sigma" within_sigma legendre_weighted.txt 3
+run "0.5\n2\n3\n0\n6\nlegendre_offset.txt\n" uniform circular --emission legendre:0,1 --offset 0.7,0.3 > /dev/null
+check "emission: off-axis point source within 3 sigma" within_sigma legendre_offset.txt 3
+run "0.5\n2\n3\n0\n6\nlegendre_aperture.txt\n" uniform circular --emission legendre:0,1 --offset 0.7,0.3 --aperture 0.25,0.3,0.5,0.1 > /dev/null
+check "emission: point source behind an aperture within 3 sigma" within_sigma legendre_aperture.txt 3
+run "0.5\n2\n3\n0\n6\n0.5\nlegendre_rectangular.txt\n" uniform rectangular --emission legendre:0,1 > /dev/null
+check "emission: rectangular point source within 3 sigma" within_sigma legendre_rectangular.txt 3
+printf -- "-1 0.5\n1 1.5\n" > emission_table.txt
+run "0.5\n2\n3\n0\n6\nemission_table_run.txt\n" uniform circular --emission table:emission_table.txt > /dev/null
+check "emission: table counts of the same Legendre model" same_counts emission_table_run.txt legendre.txt
+check "emission: negative Legendre model refused" grep -q ERROR <(run "0.5\n2\n3\n0\n5\nnegative.txt\n" uniform circular --emission legendre:1.5)
+printf -- "-1 -0.5\n1 1.5\n" > negative_table.txt
+check "emission: negative table refused" grep -q ERROR <(run "0.5\n2\n3\n0\n5\nnegative.txt\n" uniform circular --emission table:negative_table.txt)
+check "emission: malformed Legendre coefficient refused" grep -q ERROR <(run "0.5\n2\n3\n0\n5\nmalformed.txt\n" uniform circular --emission legendre:abc)
+printf -- "-1 1\n0 1\n0 2\n1 2\n" > step_table.txt
+check "emission: repeated cos theta refused" grep -q ERROR <(run "0.5\n2\n3\n0\n5\nstep.txt\n" uniform circular --emission table:step_table.txt)
+
+
+# Source depth: a vanishing depth keeps the source and emission draws, and point sources in a slab or an exponential profile match the depth-averaged point source, also with the detector in the source plane
+run "1\n2\n3\n0.5\n5\ndepth_thin.txt\n" uniform circular --depth uniform:1e-9 > /dev/null
+check "depth: vanishing depth counts" same_counts depth_thin.txt direct.txt
+run "0.5\n2\n3\n0\n6\ndepth_slab.txt\n" uniform circular --depth uniform:0.5 > /dev/null
+check "depth: slab point source within 3 sigma" within_sigma depth_slab.txt 3
+run "0.5\n2\n3\n0\n6\ndepth_exponential.txt\n" uniform circular --depth exponential:0.3 > /dev/null
+check "depth: exponential point source within 3 sigma" within_sigma depth_exponential.txt 3
+run "0\n1\n2\n0\n6\ndepth_surface.txt\n" uniform circular --depth uniform:0.5 > /dev/null
+check "depth: source plane at z/rd = 0 within 3 sigma" within_sigma depth_surface.txt 2
+
+
+# Offset maps: grid values and point sources agree with direct runs at the same offsets, the map is symmetric for a coaxial detector, and invalid detectors and sources are refused
+run "1\n0.5\n6\n0.5\n3\noffset_map.gtab\n" offsetmap uniform circular > /dev/null
+run "1\n2\n2\n0.5\n6\noffset_direct.txt\n" uniform circular --offset 0.5,0 > /dev/null
+map_value(){
+    paste <(gtab_array offset_map.gtab value) <(gtab_array offset_map.gtab error) | awk -v i="$1" 'NR == i + 1 {print $1, $2}'
+}
+check "offsetmap: axes" [ "$(gtab_key offset_map.gtab axes)" == "offset_y,offset_x" ]
+read value error <<< "$(map_value 4)"
+check "offsetmap: centre within 3 sigma of a direct run" near "$value" "$(awk -F'\t' 'NR == 3 {print $3}' direct_7.txt)" "$(awk -v e="$error" 'BEGIN {print 3 * sqrt(2) * e}')"
+read value error <<< "$(map_value 5)"
+check "offsetmap: offset (0.5, 0) within 3 sigma of a direct run" near "$value" "$(awk -F'\t' 'NR == 3 {print $3}' offset_direct.txt)" "$(awk -v e="$error" 'BEGIN {print 3 * sqrt(2) * e}')"
+check "offsetmap: point source at (0.5, 0)" [ "$(gtab_array offset_map.gtab point_source | sed -n 6p)" == "$(awk -F'\t' 'NR == 3 {print $2}' offset_direct.txt)" ]
+check "offsetmap: symmetric in x" near "$(map_value 3 | cut -d' ' -f1)" "$(map_value 5 | cut -d' ' -f1)" "$(awk -v e="$error" 'BEGIN {print 3 * sqrt(2) * e}')"
+run "1\n0.5\n5\n0.5\n3\noffset_map_emission.gtab\n" offsetmap uniform circular --emission legendre:0,1 > /dev/null
+run "1\n2\n2\n0.5\n5\noffset_emission.txt\n" uniform circular --offset 0.5,0 --emission legendre:0,1 > /dev/null
+check "offsetmap: point source with emission at (0.5, 0)" [ "$(gtab_array offset_map_emission.gtab point_source | sed -n 6p)" == "$(awk -F'\t' 'NR == 3 {print $2}' offset_emission.txt)" ]
+check "offsetmap: annulus without a ring refused" grep -q ERROR <(run "1\n0.5\n5\n0.5\n0.5\n3\noffset_map_ring.gtab\n" offsetmap uniform annular)
+check "offsetmap: negative source refused" grep -q ERROR <(run "1\n-0.5\n5\n0.5\n3\noffset_map_negative.gtab\n" offsetmap uniform circular)
+
+
+# Landing histograms: every detector hit lands inside the histogram around the detector, and a refined histogram equals a direct one
+run "1\n2\n2\n0.5\n5\nlanding.txt\n" uniform circular --landing 1,4 > /dev/null
+check "landing: shape" [ "$(gtab_key landing.txt.landing.gtab shape)" == "2,4,4" ]
+check "landing: detector hits inside the histogram" [ "$(gtab_sum landing.txt.landing.gtab hits)" -ge "$(awk -F'\t' 'NR > 2 {n += $5} END {print n}' landing.txt)" ]
+run "6\n0\n" uniform circular --refine landing.txt > /dev/null
+run "1\n2\n2\n0.5\n6\nlanding_direct.txt\n" uniform circular --landing 1,4 > /dev/null
+check "landing: refined histogram" same_array landing.txt.landing.gtab landing_direct.txt.landing.gtab hits
+
+
+# Radial response: the cumulative histogram at r = 1 and a response of 1 inside r = 1 both give the efficiency of the detector
+run "1\n2\n2\n0.5\n5\nradial.txt\n" uniform circular --radial 2,4 > /dev/null
+check "radial: cumulative efficiency at the detector edge" [ "$(gtab_array radial.txt.radial.gtab cumulative | awk 'NR % 4 == 1' | tr '\n' ' ')" == "$(awk -F'\t' 'NR > 2 {printf "%s ", $3}' radial.txt)" ]
+printf "0 1\n1 1\n" > response_edge.txt
+check "response: hard edge gives the efficiency" [ "$(./isotropic.exe response radial.txt response_edge.txt | awk 'NR > 1 {print $1, $2}')" == "$(awk -F'\t' 'NR > 2 {print $1, $3}' radial.txt)" ]
+
+
+# Intervals: closed forms at zero hits, the Wilson interval and ring uncertainty of an annular run, and a Clopper-Pearson interval around the Wilson one
+run "1000\n1001\n2\n0\n3\nzero_wilson.txt\n" uniform circular > /dev/null
+run "1000\n1001\n2\n0\n3\nzero_clopper.txt\n" uniform circular --interval clopper-pearson > /dev/null
+check "interval: Wilson at zero hits" [ "$(awk -F'\t' 'NR > 2 {print $5, $9, $10}' zero_wilson.txt | sort -u)" == "0 0 $(awk 'BEGIN {z = 1.959963985; printf "%.6g", 50 * z * z / (1000 + z * z)}')" ]
+check "interval: Clopper-Pearson at zero hits" [ "$(awk -F'\t' 'NR > 2 {print $5, $9, $10}' zero_clopper.txt | sort -u)" == "0 0 $(awk 'BEGIN {printf "%.6g", 50 * (1 - 0.025 ^ (1 / 1000))}')" ]
+check "interval: Wilson interval of the ring" awk -F'\t' 'NR > 2 {z = 1.959963985; n = $7; p = ($5 - $6) / n; c = (p + z * z / (2 * n)) / (1 + z * z / n); h = z * sqrt(p * (1 - p) / n + z * z / (4 * n * n)) / (1 + z * z / n); if ((50 * (c - h) - $9) ^ 2 > 1e-10 * $9 ^ 2 || (50 * (c + h) - $10) ^ 2 > 1e-10 * $10 ^ 2) exit 1}' direct_6.txt
+check "interval: multinomial ring uncertainty" awk -F'\t' 'NR > 2 {p = ($5 - $6) / $7; if ((100 * sqrt((1 - p) / ($5 - $6)) - $4) ^ 2 > 1e-10 * $4 ^ 2) exit 1}' direct_6.txt
+run "1\n2\n2\n0.5\n6\n2\nclopper.txt\n" uniform annular --interval clopper-pearson > /dev/null
+check "interval: Clopper-Pearson contains Wilson" awk -F'\t' 'NR == FNR && FNR > 2 {l[FNR] = $9; u[FNR] = $10} NR > FNR && FNR > 2 && ($9 > l[FNR] || $10 < u[FNR] || $9 == "") {exit 1}' direct_6.txt clopper.txt
+
+
+# Weight statistics: equal weights give as many effective samples as hits, and a refined weighted .gtab output agrees with a direct run
+run "1\n2\n2\n0.5\n5\nweights_equal.txt\n" uniform circular --emission legendre:0 --weighted > /dev/null
+check "weights: equal weights give the hits as effective samples" awk -F'\t' 'NR > 2 && $5 != $9 {exit 1} END {exit NR != 4}' weights_equal.txt
+run "1\n2\n2\n0.5\n5\n2\nweights.gtab\n" uniform annular --emission legendre:0.5 --weighted > /dev/null
+run "6\n0\n" uniform annular --refine weights.gtab > /dev/null
+./isotropic.exe merge weights_refined.txt weights.gtab > /dev/null
+run "1\n2\n2\n0.5\n6\n2\nweights_direct.txt\n" uniform annular --emission legendre:0.5 --weighted > /dev/null
+check "weights: refine gives the counts of a direct run" same_counts weights_refined.txt weights_direct.txt
+check "weights: refine gives the statistics of a direct run" awk -F'\t' 'NR == FNR && FNR > 2 {for (c = 3; c <= 11; c++) d[FNR, c] = $c} NR > FNR && FNR > 2 {for (c = 3; c <= 11; c++) if (($c - d[FNR, c]) ^ 2 > 1e-8 * $c ^ 2) exit 1}' weights_refined.txt weights_direct.txt
+
+
+# Threshold queries: clear cases stop after the first block, the interval is reported at the level of the deciding look, a capped query uses the samples of a direct run, and invalid detectors and sources are refused
+run "1\n0.5\n13.1\n95\n8\n" threshold uniform circular > threshold_above.txt
+check "threshold: above" grep -q "^Decision:[[:space:]]above 13.1%" threshold_above.txt
+check "threshold: interval at the level of the first look" awk -F'\t' '/^97.5% interval/ {split($2, b, " - "); found = b[1] > 13.1} END {exit !found}' threshold_above.txt
+check "threshold: below with a sequential probability ratio test" grep -q "^Decision:[[:space:]]below 14.5%" <(run "1\n0.5\n14.5\n95\n8\n" threshold uniform circular --sprt 0.2)
+run "1\n0.5\n13.77\n95\n5\n" threshold uniform circular > threshold_capped.txt
+check "threshold: undecided within the sample cap" grep -q "^Decision:[[:space:]]undecided at 13.77%" threshold_capped.txt
+check "threshold: capped query uses the samples of a direct run" [ "$(awk -F'\t' '/^Efficiency/ {split($2, e, " "); print e[1]}' threshold_capped.txt)" == "$(awk -F'\t' 'NR == 3 {print $3}' direct.txt)" ]
+check "threshold: interval level after five looks" grep -q "^99.8333% interval" threshold_capped.txt
+check "threshold: annulus without a ring refused" grep -q ERROR <(run "1\n0.5\n0.5\n13.1\n95\n5\n" threshold uniform annular)
+check "threshold: negative source refused" grep -q ERROR <(run "1\n-0.5\n13.1\n95\n5\n" threshold uniform circular)
+
+
+echo "$n_failed failed check(s)"
+exit $n_failed